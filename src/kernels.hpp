@@ -0,0 +1,110 @@
+/******************************************************************************\
+* Copyright (c) 2023, Robert van Engelen, Genivia Inc. All rights reserved.    *
+*                                                                              *
+* Redistribution and use in source and binary forms, with or without           *
+* modification, are permitted provided that the following conditions are met:  *
+*                                                                              *
+*   (1) Redistributions of source code must retain the above copyright notice, *
+*       this list of conditions and the following disclaimer.                  *
+*                                                                              *
+*   (2) Redistributions in binary form must reproduce the above copyright      *
+*       notice, this list of conditions and the following disclaimer in the    *
+*       documentation and/or other materials provided with the distribution.   *
+*                                                                              *
+*   (3) The name of the author may not be used to endorse or promote products  *
+*       derived from this software without specific prior written permission.  *
+*                                                                              *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF         *
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO   *
+* EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,       *
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, *
+* PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;  *
+* OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,     *
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR      *
+* OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF       *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                                   *
+\******************************************************************************/
+
+/**
+@file      kernels.hpp
+@brief     indexing kernels to hash n-grams into Bloom filters
+@author    Robert van Engelen - engelen@genivia.com
+@copyright (c) 2023-2025, Robert van Engelen, Genivia Inc. All rights reserved.
+@copyright (c) BSD-3 License - see LICENSE.txt
+*/
+
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// check if we are compiling for x86 or x64 to use SSE2, AVX2 and AVX-512 kernels
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+# define HAVE_X86_KERNELS
+#endif
+
+// the maximum number of rows of a table counted with fold_levels(), i.e. 65536 / 128
+#define FOLD_MAX_ROWS 512
+
+// the maximum number of fold levels counted with fold_levels(), i.e. log2(FOLD_MAX_ROWS)
+#define FOLD_MAX_LEVELS 9
+
+// prime 61 mod 2^16 file indexing hash function
+inline uint32_t indexhash(uint32_t h, uint8_t b)
+{
+  return static_cast<uint16_t>((h << 6) - h - h - h + b);
+}
+
+// the maximum number of bits of the wide hashes of tables larger than 64KB, see option --hash-bits
+#define HASH_MAX_BITS 24
+
+// prime 61 mod 2^32 wide file indexing hash function, the low 16 bits are the indexhash() of the low 16 bits of h, so a wide table folded down to 64KB is the table of indexhash()
+inline uint32_t indexhash_wide(uint32_t h, uint8_t b)
+{
+  return (h << 6) - h - h - h + b;
+}
+
+// indexing kernels for a specific instruction set, selected at startup
+struct Kernel {
+
+  // kernel name for option --kernel=NAME
+  const char *name;
+
+  // returns true if the CPU supports the kernel
+  bool (*supported)();
+
+  // hash the 1-grams to 8-grams of the windows starting at window[0..n-1] into 8 staggered Bloom filters hashes[0..mask], where mask is 65535 or the mask of a smaller folded table, note that window[0..n+6] must be valid
+  void (*hash_windows)(uint8_t *hashes, uint32_t mask, const uint8_t *window, size_t n);
+
+  // return true if s[0..n-1] contains a \0 (NUL) or a non-displayable invalid UTF-8 sequence
+  bool (*is_binary)(const char *s, size_t n);
+
+  // count the zero bits (hits) zeros[k] of the table hashes[0..n-1] halved k times for k in [0,log2(n/m)] in one pass, where n and m are powers of two, m >= 64 and n/m <= FOLD_MAX_ROWS
+  void (*fold_levels)(const uint8_t *hashes, size_t n, size_t m, size_t *zeros);
+
+  // fold the table hashes[0..n-1] in place down to m bytes, hashes[i] &= hashes[i + j * m] for i in [0,m) and j in [1,n/m)
+  void (*fold)(uint8_t *hashes, size_t n, size_t m);
+
+};
+
+// hash the 1-grams to 8-grams of the windows starting at window[0..n-1] with indexhash_wide() into 8 staggered Bloom filters hashes[0..mask] of a table larger than 64KB, note that window[0..n+6] must be valid
+void hash_windows_wide(uint8_t *hashes, uint32_t mask, const uint8_t *window, size_t n);
+
+// the kernels from slowest to fastest, the first is the scalar reference kernel
+extern const Kernel kernels[];
+
+// the number of kernels
+extern const size_t num_kernels;
+
+// the selected kernel, the scalar kernel until select_kernel() is called, main() selects the fastest kernel supported by the CPU at startup
+extern const Kernel *kernel;
+
+// select the named kernel or the fastest supported kernel when name is "auto", returns false when unknown or not supported by the CPU
+bool select_kernel(const char *name);
+
+// check the kernel against the scalar reference kernel on random inputs, returns false when the kernel produces different results
+bool self_test_kernel(const Kernel& candidate);
+
+#endif
@@ -75,6 +75,7 @@
 // 64 bits off_t and fseeko
 #define off_t int64_t
 #define fseeko _fseeki64
+#define ftello _ftelli64
 #define ftruncate _chsize_s
 
 #define STDIN_FILENO  0
@@ -135,6 +136,14 @@ int fopenw_s(FILE **file, const char *filename, const char *mode)
   return 0;
 }
 
+// rename UTF-8 encoded Unicode filename, replacing an existing file
+int renamew(const char *oldname, const char *newname)
+{
+  if (MoveFileExW(utf8_decode(oldname).c_str(), utf8_decode(newname).c_str(), MOVEFILE_REPLACE_EXISTING) == 0)
+    return errno = (GetLastError() == ERROR_ACCESS_DENIED ? EACCES : ENOENT);
+  return 0;
+}
+
 // get modification time (micro seconds) from directory entry
 inline uint64_t modified_time(const WIN32_FIND_DATAW& ffd)
 {
@@ -142,18 +151,125 @@ inline uint64_t modified_time(const WIN32_FIND_DATAW& ffd)
   return static_cast<uint64_t>(time.dwLowDateTime) | (static_cast<uint64_t>(time.dwHighDateTime) << 32);
 }
 
+// get modification time (micro seconds) of an open file descriptor or 0 when unknown
+inline uint64_t modified_time(int fd)
+{
+  FILETIME time;
+  if (GetFileTime(reinterpret_cast<HANDLE>(_get_osfhandle(fd)), NULL, NULL, &time) == 0)
+    return 0;
+  return static_cast<uint64_t>(time.dwLowDateTime) | (static_cast<uint64_t>(time.dwHighDateTime) << 32);
+}
+
+// get modification time (micro seconds) of a file or 0 when the file does not exist
+inline uint64_t modified_time(const std::string& pathname)
+{
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if (GetFileAttributesExW(utf8_decode(pathname).c_str(), GetFileExInfoStandard, &data) == 0 || (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+    return 0;
+  return static_cast<uint64_t>(data.ftLastWriteTime.dwLowDateTime) | (static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32);
+}
+
+// get the volume serial number and the file index of a directory, returns false when unknown
+bool directory_id(const std::string& pathname, uint64_t& dev, uint64_t& ino)
+{
+  HANDLE hFile = CreateFileW(utf8_decode(pathname).c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  if (hFile == INVALID_HANDLE_VALUE)
+    return false;
+  BY_HANDLE_FILE_INFORMATION info;
+  bool ok = GetFileInformationByHandle(hFile, &info) != 0;
+  CloseHandle(hFile);
+  if (!ok)
+    return false;
+  dev = info.dwVolumeSerialNumber;
+  ino = static_cast<uint64_t>(info.nFileIndexLow) | (static_cast<uint64_t>(info.nFileIndexHigh) << 32);
+  return true;
+}
+
+// get the absolute pathname of a UTF-8 encoded Unicode pathname or the pathname when unknown
+std::string real_pathname(const std::string& pathname)
+{
+  wchar_t *path = _wfullpath(NULL, utf8_decode(pathname).c_str(), 0);
+  if (path == NULL)
+    return pathname;
+  std::string real(utf8_encode(path));
+  free(path);
+  return real;
+}
+
+// make a directory with a UTF-8 encoded Unicode pathname
+int makedir(const char *pathname)
+{
+  return _wmkdir(utf8_decode(pathname).c_str()) != 0 ? errno ? errno : (errno = EINVAL) : 0;
+}
+
+// get the current time (micro seconds) in the units of modified_time()
+inline uint64_t current_time()
+{
+  FILETIME time;
+  GetSystemTimeAsFileTime(&time);
+  return static_cast<uint64_t>(time.dwLowDateTime) | (static_cast<uint64_t>(time.dwHighDateTime) << 32);
+}
+
+// option --xattr is not supported by windows, extended attributes are not present
+inline int64_t get_xattr(const char *, const char *, void *, size_t)
+{
+  errno = ENOTSUP;
+  return -1;
+}
+
+// option --xattr is not supported by windows, extended attributes cannot be set
+inline int set_xattr(const char *, const char *, const void *, size_t)
+{
+  return errno = ENOTSUP;
+}
+
+// option --xattr is not supported by windows, extended attributes cannot be removed
+inline int remove_xattr(const char *, const char *)
+{
+  return errno = ENOTSUP;
+}
+
 // get file size from directory entry
 inline uint64_t file_size(const WIN32_FIND_DATAW& ffd)
 {
   return static_cast<uint64_t>(ffd.nFileSizeLow) | (static_cast<uint64_t>(ffd.nFileSizeHigh) << 32);
 }
 
+// get file size of an open file descriptor or 0 when unknown
+inline uint64_t file_size(int fd)
+{
+  LARGE_INTEGER size;
+  if (GetFileSizeEx(reinterpret_cast<HANDLE>(_get_osfhandle(fd)), &size) == 0)
+    return 0;
+  return static_cast<uint64_t>(size.QuadPart);
+}
+
+// option --no-cache is not supported by windows
+inline void no_cache(int)
+{ }
+
+// option --no-cache is not supported by windows
+inline void drop_cache(int, uint64_t = 0, uint64_t = 0)
+{ }
+
+// files are not memory mapped with windows
+inline const uint8_t *map_file(int, uint64_t)
+{
+  return NULL;
+}
+
+// files are not memory mapped with windows
+inline void unmap_file(const uint8_t *, uint64_t)
+{ }
+
 #else // not compiling for a windows OS
 
 #include <signal.h>
+#include <setjmp.h>
 #include <dirent.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <cerrno>
 #include <cstdlib>
@@ -167,8 +283,10 @@ inline uint64_t file_size(const WIN32_FIND_DATAW& ffd)
 # include "config.h"
 #endif
 
-#if defined(HAVE_F_RDAHEAD)
-# include <fcntl.h>
+#include <fcntl.h>
+
+#if defined(HAVE_SYS_XATTR_H)
+# include <sys/xattr.h>
 #endif
 
 #define PATHSEPCHR '/'
@@ -195,6 +313,12 @@ int fopenw_s(FILE **file, const char *filename, const char *mode)
   return (*file = fopen(filename, mode)) == NULL ? errno ? errno : (errno = EINVAL) : 0;
 }
 
+// rename UTF-8 encoded Unicode filename, replacing an existing file
+int renamew(const char *oldname, const char *newname)
+{
+  return rename(oldname, newname) != 0 ? errno ? errno : (errno = EINVAL) : 0;
+}
+
 // get modification time (micro seconds) from stat
 inline uint64_t modified_time(const struct stat& buf)
 {
@@ -209,12 +333,189 @@ inline uint64_t modified_time(const struct stat& buf)
 #endif
 }
 
+// get modification time (micro seconds) of an open file descriptor or 0 when unknown
+inline uint64_t modified_time(int fd)
+{
+  struct stat buf;
+  if (fstat(fd, &buf) != 0)
+    return 0;
+  return modified_time(buf);
+}
+
+// get modification time (micro seconds) of a file or 0 when the file does not exist
+inline uint64_t modified_time(const std::string& pathname)
+{
+  struct stat buf;
+  if (stat(pathname.c_str(), &buf) != 0 || !S_ISREG(buf.st_mode))
+    return 0;
+  return modified_time(buf);
+}
+
+// get the device and inode numbers of a directory, returns false when unknown
+bool directory_id(const std::string& pathname, uint64_t& dev, uint64_t& ino)
+{
+  struct stat buf;
+  if (stat(pathname.c_str(), &buf) != 0)
+    return false;
+  dev = static_cast<uint64_t>(buf.st_dev);
+  ino = static_cast<uint64_t>(buf.st_ino);
+  return true;
+}
+
+// get the absolute pathname without symbolic links or the pathname when unknown
+std::string real_pathname(const std::string& pathname)
+{
+  char *path = realpath(pathname.c_str(), NULL);
+  if (path == NULL)
+    return pathname;
+  std::string real(path);
+  free(path);
+  return real;
+}
+
+// make a directory
+int makedir(const char *pathname)
+{
+  return mkdir(pathname, 0777) != 0 ? errno ? errno : (errno = EINVAL) : 0;
+}
+
+// get the current time (micro seconds) in the units of modified_time() of the clock that time stamps modified files
+inline uint64_t current_time()
+{
+#if (defined(HAVE_STAT_ST_ATIM) && defined(HAVE_STAT_ST_MTIM) && defined(HAVE_STAT_ST_CTIM)) || (defined(HAVE_STAT_ST_ATIMESPEC) && defined(HAVE_STAT_ST_MTIMESPEC) && defined(HAVE_STAT_ST_CTIMESPEC))
+  struct timespec time;
+#if defined(CLOCK_REALTIME_COARSE)
+  if (clock_gettime(CLOCK_REALTIME_COARSE, &time) != 0)
+    return 0;
+#else
+  if (clock_gettime(CLOCK_REALTIME, &time) != 0)
+    return 0;
+#endif
+  return static_cast<uint64_t>(static_cast<uint64_t>(time.tv_sec) * 1000000 + time.tv_nsec / 1000);
+#else
+  return static_cast<uint64_t>(time(NULL));
+#endif
+}
+
+// get the value of an extended attribute of a file, or the size of the value when size is zero, returns -1 when not present or not supported
+inline int64_t get_xattr(const char *pathname, const char *name, void *value, size_t size)
+{
+#if defined(HAVE_SYS_XATTR_H) && defined(__APPLE__)
+  return static_cast<int64_t>(getxattr(pathname, name, value, size, 0, 0));
+#elif defined(HAVE_SYS_XATTR_H)
+  return static_cast<int64_t>(getxattr(pathname, name, value, size));
+#else
+  (void)pathname;
+  (void)name;
+  (void)value;
+  (void)size;
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+// set the value of an extended attribute of a file
+inline int set_xattr(const char *pathname, const char *name, const void *value, size_t size)
+{
+#if defined(HAVE_SYS_XATTR_H) && defined(__APPLE__)
+  return setxattr(pathname, name, value, size, 0, 0) != 0 ? errno ? errno : (errno = EINVAL) : 0;
+#elif defined(HAVE_SYS_XATTR_H)
+  return setxattr(pathname, name, value, size, 0) != 0 ? errno ? errno : (errno = EINVAL) : 0;
+#else
+  (void)pathname;
+  (void)name;
+  (void)value;
+  (void)size;
+  return errno = ENOTSUP;
+#endif
+}
+
+// remove an extended attribute of a file
+inline int remove_xattr(const char *pathname, const char *name)
+{
+#if defined(HAVE_SYS_XATTR_H) && defined(__APPLE__)
+  return removexattr(pathname, name, 0) != 0 ? errno ? errno : (errno = EINVAL) : 0;
+#elif defined(HAVE_SYS_XATTR_H)
+  return removexattr(pathname, name) != 0 ? errno ? errno : (errno = EINVAL) : 0;
+#else
+  (void)pathname;
+  (void)name;
+  return errno = ENOTSUP;
+#endif
+}
+
 // get file size from stat
 inline uint64_t file_size(const struct stat& buf)
 {
   return static_cast<uint64_t>(buf.st_size);
 }
 
+// get file size of an open file descriptor or 0 when unknown
+inline uint64_t file_size(int fd)
+{
+  struct stat buf;
+  if (fstat(fd, &buf) != 0 || !S_ISREG(buf.st_mode))
+    return 0;
+  return file_size(buf);
+}
+
+// do not cache the pages of a file opened to read (MacOS), for option --no-cache
+inline void no_cache(int fd)
+{
+#if defined(F_NOCACHE)
+  fcntl(fd, F_NOCACHE, 1);
+#else
+  (void)fd;
+#endif
+}
+
+// drop the cached pages of a file read at [offset,offset+length) or of the whole file when length is zero, for option --no-cache
+inline void drop_cache(int fd, uint64_t offset = 0, uint64_t length = 0)
+{
+#if defined(POSIX_FADV_DONTNEED)
+  posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(length), POSIX_FADV_DONTNEED);
+#else
+  (void)fd;
+  (void)offset;
+  (void)length;
+#endif
+}
+
+// map a file of the given size to read sequentially, returns NULL when the file cannot be mapped
+inline const uint8_t *map_file(int fd, uint64_t size)
+{
+  if (size == 0 || size > SIZE_MAX)
+    return NULL;
+  void *map = mmap(NULL, static_cast<size_t>(size), PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+#if defined(MADV_SEQUENTIAL)
+  madvise(map, static_cast<size_t>(size), MADV_SEQUENTIAL);
+#endif
+  return static_cast<const uint8_t*>(map);
+}
+
+// release the pages of a mapped file and unmap the file
+inline void unmap_file(const uint8_t *map, uint64_t size)
+{
+#if defined(MADV_DONTNEED)
+  madvise(const_cast<uint8_t*>(map), static_cast<size_t>(size), MADV_DONTNEED);
+#endif
+  munmap(const_cast<uint8_t*>(map), static_cast<size_t>(size));
+}
+
+// the jump buffer of a thread hashing a mapped file, to recover from SIGBUS when the file is truncated while mapped
+static thread_local sigjmp_buf *sigbus_jmp = NULL;
+
+// SIGBUS handler jumps back to the thread hashing a mapped file that was truncated
+void sigbus_handler(int sig)
+{
+  if (sigbus_jmp != NULL)
+    siglongjmp(*sigbus_jmp, 1);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
 #endif
 
 // platform -- see configure.ac
@@ -242,13 +543,20 @@ inline uint64_t file_size(const struct stat& buf)
 
 #include "reflex/input.h"
 #include "glob.hpp"
+#include "kernels.hpp"
+#include "uring.hpp"
 #include <cctype>
 #include <cinttypes>
 #include <iostream>
 #include <algorithm>
 #include <memory>
 #include <vector>
+#include <deque>
 #include <stack>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 // number of bytes to gulp into the buffer to index a file
 #define BUF_SIZE 65536
@@ -259,6 +567,48 @@ inline uint64_t file_size(const struct stat& buf)
 // smallest possible power-of-two size of an index of a file, shoud be > 61
 #define MIN_SIZE 128
 
+// the number of bytes of a large file per byte of its hashes table with --hash-bits, files larger than 8 * 64KB get tables larger than 64KB
+#define WIDE_RATIO 8
+
+// smallest range of a large file to hash in parallel with other ranges of the file
+#define RANGE_SIZE 16777216
+
+// smallest large file to hash directly from a memory mapping instead of reading the file into the buffer
+#define MMAP_SIZE 1048576
+
+// the size of the header of a format 4 index file
+#define V4_HEADER_SIZE 64
+
+// the alignment of the hashes tables in a format 4 index file
+#define V4_ALIGN 64
+
+// the table of contents of a format 4 index file restarts front-coding of basenames every V4_RESTART entries
+#define V4_RESTART 16
+
+// the minimum number of files of a group of bit-sliced tables with --slices, the tables of smaller groups are stored separately
+#define SLICES_MIN 32
+
+// the lane of a file in the table of contents when its table is not bit-sliced
+#define SLICES_NONE 0xffff
+
+// the bit of the accuracy byte of a record that marks a hashes table of case-folded n-grams indexed with --ignore-case
+#define ACCURACY_FOLDED 0x80
+
+// the number of shards of the posting lists of a segment of the trigram index written with --trigrams
+#define GRAMS_SHARDS 256
+
+// the number of trigram and file ID pairs collected in memory before the pairs are written as a segment of the trigram index
+#define GRAMS_FLUSH 4194304
+
+// the number of segments of the trigram index that are merged into one segment when exceeded
+#define GRAMS_MAX_SEGMENTS 16
+
+// the size of the extended attribute of a directory with the index time stored with --xattr
+#define XATTR_STAMP_SIZE 16
+
+// default --append=PERCENT argument, the percentage of garbage records in an index file to compact the index file
+#define DEFAULT_APPEND 50
+
 // default --ignore-files=FILE argument
 #define DEFAULT_IGNORE_FILE ".gitignore"
 
@@ -273,7 +623,17 @@ typedef std::vector<std::string> StrVec;
 
 // fixed constant strings
 static const char ugrep_index_filename[] = "._UG#_Store";
+static const char ugrep_index_tempname[] = "._UG#_Store.tmp";
 static const char ugrep_index_file_magic[5] = "UG#\x03";
+static const char ugrep_index_file_magic_v4[5] = "UG#\x04";
+static const char ugrep_tree_filename[] = "._UG#_Tree";
+static const char ugrep_tree_tempname[] = "._UG#_Tree.tmp";
+static const char ugrep_tree_file_magic[5] = "UG#T";
+static const char ugrep_grams_filename[] = "._UG#_Grams";
+static const char ugrep_grams_tempname[] = "._UG#_Grams.tmp";
+static const char ugrep_grams_file_magic[5] = "UG#G";
+static const char ugrep_index_xattr[] = "user.ugrep.index";
+static const char ugrep_index_xattr_magic[5] = "UG#X";
 static const char ugrep_indexer_config_filename[] = ".ugrep-indexer";
 
 // command-line optional PATH argument
@@ -281,22 +641,43 @@ const char *arg_path = NULL;
 
 // command-line options
 int    flag_accuracy          = 4;     // -0 ... -9 (--accuracy) default is -4
+size_t flag_append            = 0;     // --append=PERCENT 0 rewrites index files without tombstones
+size_t flag_blocks            = 0;     // --blocks=MB 0 indexes large files with one hashes table
 bool   flag_check             = false; // -c (--check)
+bool   flag_database          = false; // --database
 bool   flag_decompress        = false; // -z (--decompress)
 bool   flag_delete            = false; // -d (--delete)
 bool   flag_dereference_files = false; // -S (--dereference-files)
 bool   flag_force             = false; // -f (--force)
+int    flag_format            = 0;     // --format=3 or 4, 0 keeps the format of index files
+size_t flag_hash_bits         = 16;    // --hash-bits=BITS 16 limits hashes tables to 64KB
 bool   flag_hidden            = false; // -. (--hidden)
 bool   flag_ignore_binary     = false; // -I (--ignore-binary)
+bool   flag_ignore_case       = false; // --ignore-case
+size_t flag_jobs              = 0;     // -J (--jobs) 0 is the number of hardware threads
+bool   flag_no_cache          = false; // --no-cache
 bool   flag_no_messages       = false; // -s (--no-messages)
 bool   flag_quiet             = false; // -q (--quiet)
+int    flag_readers           = -1;    // --readers -1 is the number of -J threads
+bool   flag_self_test         = false; // --self-test
+size_t flag_slices            = 0;     // --slices=WIDTH 0 stores the hashes table of each file separately
+bool   flag_trigrams          = false; // --trigrams
 bool   flag_usage_warnings    = false; // internal flag
 bool   flag_verbose           = false; // -v (--verbose)
+bool   flag_xattr             = false; // --xattr
 size_t flag_zmax              = 1;     // --zmax
 StrVec flag_ignore_files;              // -X (--ignore-files)
+std::string flag_index_root;           // --index-root=DIR
+
+// the root of the directory tree as specified and its absolute pathname, to name the index files stored with --index-root
+std::string tree_root;
+std::string tree_root_real;
+
+// count warnings, atomic because warnings are also produced by the worker and decompression threads
+std::atomic_size_t warnings(0);
 
-// count warnings
-size_t warnings = 0;
+// count the range threads running, atomic because the worker threads share a budget of range threads to hash large files in parallel
+std::atomic_size_t range_threads(0);
 
 // ignore (exclude) files/dirs globs, a glob prefixed with ! means override to include
 struct Ignore {
@@ -304,9 +685,6 @@ struct Ignore {
   StrVec dirs;
 };
 
-// stack of ignore file/dir globs per ignore-file found
-std::stack<Ignore> ignore_stack;
-
 // entry data extracted from directory contents, constructor moves pathname string to this entry
 struct Entry {
 
@@ -360,12 +738,84 @@ struct Entry {
 
 };
 
+// directory entry and its catalogued contents, catalogued by a walker thread or by the main thread
+struct Dir {
+
+  // the state of a directory to catalog
+  enum State { QUEUED, BUSY, DONE };
+
+  // indexing is initiated with the pathname to the root of the directory to index
+  Dir(const char *pathname = ".")
+    :
+      visit(pathname),
+      index_time(0),
+      xattr(false),
+      xattr_time(0),
+      visit_time(0),
+      last_time(0),
+      num_dirs(0),
+      num_links(0),
+      num_other(0),
+      ign_dirs(0),
+      ign_files(0),
+      state(QUEUED)
+  { }
+
+  // new subdirectory entry, note this moves the pathname to the entry that owns it now, the subdirectory inherits the ignore globs
+  Dir(std::string& pathname, size_t base, uint64_t mtime, uint64_t size, const std::shared_ptr<const Ignore>& ignore)
+    :
+      visit(pathname, base, mtime, size),
+      ignore(ignore),
+      index_time(0),
+      xattr(false),
+      xattr_time(0),
+      visit_time(0),
+      last_time(0),
+      num_dirs(0),
+      num_links(0),
+      num_other(0),
+      ign_dirs(0),
+      ign_files(0),
+      state(QUEUED)
+  { }
+
+  Entry                             visit;        // the directory entry
+  std::shared_ptr<const Ignore>     ignore;       // ignore globs of the nearest ignore file found in the parent directories or NULL
+  std::vector<Entry>                file_entries; // catalogued files
+  std::vector<std::shared_ptr<Dir>> dir_entries;  // catalogued subdirectories in directory order
+  std::string                       index_file;   // the index file pathname with --index-root, empty when the directory cannot be identified
+  uint64_t                          index_time;   // modification time of the index file or zero when not present
+  bool                              xattr;        // true when the directory has an extended attribute with the index time stored with --xattr
+  uint64_t                          xattr_time;   // the index time stored in the extended attribute of the directory
+  uint64_t                          visit_time;   // the time the directory was catalogued with --xattr, before its files were stat'ed
+  uint64_t                          last_time;    // last modification time of the catalogued files
+  uint64_t                          num_dirs;     // 1 if the directory was opened
+  uint64_t                          num_links;    // number of symbolic links skipped
+  uint64_t                          num_other;    // number of devices skipped
+  int64_t                           ign_dirs;     // number of directories ignored with --ignore-files
+  int64_t                           ign_files;    // number of files ignored with --ignore-files
+  State                             state;        // QUEUED, BUSY or DONE, protected by the walkers mutex
+
+};
+
+// a pooled buffer with a small file read ahead by a reader thread, the file is converted to UTF-8 like reflex::Input reads a file
+struct Block {
+
+  char   data[BUF_SIZE]; // the file contents
+  size_t size;           // number of bytes read into data[]
+  bool   whole;          // true if the whole file was read into data[]
+
+};
+
 // Input stream to index
 struct Stream {
 
   Stream()
     :
-      file(NULL)
+      file(NULL),
+      fd(-1),
+      peek(false),
+      block(NULL)
 #ifdef HAVE_LIBZ
 #ifdef WITH_DECOMPRESSION_THREAD
     , zthread(false, partname)
@@ -384,7 +834,75 @@ struct Stream {
   {
     if (file != NULL)
       fclose(file);
-    return fopenw_s(&file, pathname, "rb") == 0;
+    file = NULL;
+
+#ifndef OS_WIN
+    // without -z read plain files with read() from a file descriptor, bypassing FILE* and reflex::Input
+    if (!flag_decompress)
+    {
+      if (fd >= 0)
+        ::close(fd);
+#if defined(O_NOCTTY)
+      fd = ::open(pathname, O_RDONLY | O_NOCTTY);
+#else
+      fd = ::open(pathname, O_RDONLY);
+#endif
+      if (fd < 0)
+        return false;
+      if (flag_no_cache)
+        no_cache(fd);
+      peek = true;
+      return true;
+    }
+#endif
+
+    if (fopenw_s(&file, pathname, "rb") != 0)
+      return false;
+    if (flag_no_cache)
+      no_cache(fileno(file));
+    return true;
+  }
+
+  // read up to len bytes into buf, returns the number of bytes read or 0 at the end of the input
+  size_t get(char *buf, size_t len)
+  {
+    if (fd < 0)
+      return input.get(buf, len);
+
+    size_t num = 0;
+
+#ifndef OS_WIN
+    while (num < len)
+    {
+      ssize_t ret = ::read(fd, buf + num, len - num);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+        break;
+      num += static_cast<size_t>(ret);
+    }
+
+    // if the file may start with a UTF BOM, then read the file with reflex::Input instead to convert UTF-16/32 and to skip the UTF-8 BOM
+    if (peek)
+    {
+      peek = false;
+      if (num > 0 && (buf[0] == '\0' || buf[0] == '\xef' || buf[0] == '\xfe' || buf[0] == '\xff') && lseek(fd, 0, SEEK_SET) == 0)
+      {
+        file = fdopen(fd, "rb");
+        if (file == NULL)
+        {
+          ::close(fd);
+          fd = -1;
+          return 0;
+        }
+        fd = -1;
+        input = file;
+        return input.get(buf, len);
+      }
+    }
+#endif
+
+    return num;
   }
 
   void close()
@@ -393,10 +911,33 @@ struct Stream {
     if (input.file() != file && input.file() != NULL)
       fclose(input.file());
     input.clear();
-    // close the file
+#if defined(HAVE_LIBZ) && defined(WITH_DECOMPRESSION_THREAD)
+    // wait until the decompression thread stops reading the file, e.g. when a binary file is skipped with -I before the end
+    if (file != NULL && zthread.thread.joinable())
+    {
+      std::unique_lock<std::mutex> lock(zthread.pipe_mutex);
+      while (!zthread.is_waiting)
+        zthread.pipe_close.wait(lock);
+    }
+#endif
+    // close the file, drop its cached pages with --no-cache
     if (file != NULL)
+    {
+      if (flag_no_cache)
+        drop_cache(fileno(file));
       fclose(file);
+    }
     file = NULL;
+#ifndef OS_WIN
+    if (fd >= 0)
+    {
+      if (flag_no_cache)
+        drop_cache(fd);
+      ::close(fd);
+    }
+#endif
+    fd = -1;
+    block = NULL;
   }
 
 #ifdef HAVE_LIBZ
@@ -553,6 +1094,9 @@ struct Stream {
 #endif
 
   FILE *file;
+  int fd;             // file descriptor to read a plain file without -z, when FILE *file is NULL
+  bool peek;          // true until the first bytes are read from fd to check for a UTF BOM
+  const Block *block; // the file read ahead by a reader to index instead of reading the file, or NULL
   reflex::Input input;
   std::string partname;
 
@@ -577,10 +1121,42 @@ void version()
   exit(EXIT_SUCCESS);
 }
 
+// test the indexing kernels supported by the CPU against the scalar reference kernel and exit
+void self_test()
+{
+  bool ok = true;
+
+  for (size_t i = 0; i < num_kernels; ++i)
+  {
+    const Kernel& test = kernels[i];
+    if (i == 0)
+    {
+      printf("%-8s reference\n", test.name);
+    }
+    else if (!test.supported())
+    {
+      printf("%-8s not supported by this CPU\n", test.name);
+    }
+    else if (self_test_kernel(test))
+    {
+      printf("%-8s passed\n", test.name);
+    }
+    else
+    {
+      printf("%-8s FAILED\n", test.name);
+      ok = false;
+    }
+  }
+
+  printf("\nselected kernel: %s\n", kernel->name);
+
+  exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
 // display a help message and exit
 void help()
 {
-  std::cout << "\nUsage:\n\nugrep-indexer [-0|...|-9] [-.] [-c|-d|-f] [-I] [-q] [-S] [-s] [-X] [-z] [PATH]\n\n\
+  std::cout << "\nUsage:\n\nugrep-indexer [-0|...|-9] [-.] [-c|-d|-f] [-I] [-J NUM] [-q] [-S] [-s] [-X] [-z] [PATH]\n\n\
     Updates indexes incrementally unless option -f or --force is specified.\n\
     \n\
     When option -I or --ignore-binary is specified, binary files are ignored\n\
@@ -622,6 +1198,12 @@ void help()
             Force reindexing of files, even those that are already indexed.\n\
     -I, --ignore-binary\n\
             Do not index binary files.\n\
+    -J NUM, --jobs=NUM\n\
+            Specifies the number of threads spawned to catalog directories and\n\
+            the number of threads spawned to index files.  By default, the\n\
+            number of threads is the number of hardware threads.  Specify -J1\n\
+            to catalog directories and index files with the main thread only.\n\
+            The index files produced are the same for any number of threads.\n\
     -q, --quiet, --silent\n\
             Quiet mode: do not display indexing statistics.\n\
     -S, --dereference-files\n\
@@ -682,6 +1264,105 @@ void help()
             ".\n"
 #endif
             "\
+    --append, --append=PERCENT\n\
+            Append the indexed new and modified files to index files and mark\n\
+            the deleted and modified files in index files with tombstones,\n\
+            instead of rewriting index files.  An index file is compacted when\n\
+            more than PERCENT of the index file is garbage.  The default\n\
+            PERCENT is 50.  Format 4 index files are always rewritten.\n\
+    --blocks=MB\n\
+            Index plain files larger than MB megabytes in blocks of MB\n\
+            megabytes, each with its own hashes table of the n-grams that start\n\
+            in the block, stored with the offsets and sizes of the tables in\n\
+            format 4 index files after the table of the file.  A search tool\n\
+            may read only the blocks of a file that match.  A match that spans\n\
+            a block boundary matches the AND of the tables of the two blocks.\n\
+            Files are not indexed in blocks with -z or --xattr.  Implies\n\
+            --format=4.\n\
+    --database\n\
+            Write one index database file ._UG#_Tree at the root of the\n\
+            directory tree instead of an index file in each directory.  The\n\
+            database has a manifest of the directories with a section per\n\
+            directory in format 4 and is updated incrementally.  Tools can\n\
+            load the indexes of the whole tree with one memory map.  Options\n\
+            --append and --format are ignored.  Note that ugrep --index\n\
+            searches the index files in each directory.\n\
+    --format=NUM\n\
+            Write index files in format NUM, where NUM is 3 or 4.  Format 4\n\
+            index files have a table of contents of the indexed files sorted\n\
+            by name and 64-byte aligned hashes tables, for tools that memory\n\
+            map index files to look up files.  Index files in the other format\n\
+            are converted.  By default, index files are updated in their\n\
+            format and new index files are written in format 3.  Note that\n\
+            ugrep --index searches format 3 index files.\n\
+    --hash-bits=BITS\n\
+            Hash large files with BITS-bit hashes into tables of up to 2^BITS\n\
+            bytes, where BITS is 16 to 24.  A file larger than 512KB gets a\n\
+            table of up to 1/8 of its size that is folded down to the index\n\
+            accuracy, so that large files are less likely to saturate their\n\
+            table.  Compressed files and archives are hashed with 16 bits.\n\
+            The default is 16, which limits tables to 64KB.  BITS larger than\n\
+            16 implies --format=4, because ugrep --index searches format 3\n\
+            index files with 16-bit hashes.\n\
+    --ignore-case\n\
+            Hash the n-grams of files case-folded, so that case-insensitive\n\
+            searches probe one hash per n-gram instead of the hashes of all\n\
+            case permutations.  ASCII letters and Latin-1 letters encoded in\n\
+            UTF-8 are folded to lower case.  The records of case-folded tables\n\
+            are marked with bit 0x80 in their accuracy byte.  Files that are\n\
+            indexed without this option are not reindexed, unless -f is\n\
+            specified.  Implies --format=4.\n\
+    --index-root=DIR\n\
+            Store the index files in directory DIR instead of the indexed\n\
+            directories, for example to index read-only directory trees and\n\
+            to keep index files on a fast local device.  The index files are\n\
+            named by the device and inode numbers and the absolute pathname of\n\
+            the indexed directories.  With option --database, the database is\n\
+            stored in DIR.  Note that ugrep --index searches the index files in\n\
+            the indexed directories.\n\
+    --kernel=NAME\n\
+            Use the NAME indexing kernel instead of the fastest kernel that is\n\
+            supported by the CPU, where NAME is `scalar', `sse2', `avx2',\n\
+            `avx512' or `auto'.  The default is `auto'.\n\
+    --no-cache\n\
+            Do not keep indexed files in the file system cache, to preserve\n\
+            the cached working set of other processes.  Files are dropped from\n\
+            the cache after indexing.\n\
+    --readers=NUM\n\
+            Specifies the number of threads spawned to read small files ahead\n\
+            of indexing, to keep the disk busy while files are indexed.  By\n\
+            default, the number of threads is the number of -J threads.  Specify\n\
+            --readers=0 to read files with the threads that index files.\n\
+    --self-test\n\
+            Test the indexing kernels supported by the CPU against the scalar\n\
+            reference kernel on random inputs and exit.\n\
+    --slices=WIDTH\n\
+            Write format 4 index files with the hashes tables of up to WIDTH\n\
+            files of the same table size bit-sliced into groups, where WIDTH\n\
+            is 64, 256 or 512.  Each bit of the tables of a group is stored\n\
+            in a row of WIDTH bits with one bit per file, to probe the files\n\
+            of a group at once with vector instructions.  Groups of fewer than\n\
+            32 files are not bit-sliced.  Implies --format=4.\n\
+    --trigrams\n\
+            Write one trigram index file ._UG#_Grams at the root of the\n\
+            directory tree instead of an index file in each directory.  The\n\
+            trigram index is an inverted index with posting lists of file IDs\n\
+            per trigram, sharded by trigram, so that tools look up the files\n\
+            with the trigrams of a pattern in time proportional to the number\n\
+            of matching files.  The trigram index is updated incrementally\n\
+            with a segment of posting lists of the new and modified files and\n\
+            is compacted when too many segments or deleted files accumulate.\n\
+            Options -0 to -9, --append, --blocks, --format, --hash-bits and\n\
+            --slices are ignored.  Note that ugrep --index searches the index\n\
+            files in each directory.\n\
+    --xattr\n\
+            Store the indexes of files in their user.ugrep.index extended\n\
+            attribute and the index time in the extended attribute of their\n\
+            directory, instead of an index file in each directory.  Large\n\
+            indexes are folded to fit the size limit of extended attributes\n\
+            of the file system.  Index files are used on file systems that do\n\
+            not support extended attributes.  Note that ugrep --index searches\n\
+            the index files in each directory.\n\
     --zmax=NUM\n\
             When used with option -z (--decompress), indexes the contents of\n\
             compressed files and archives stored within archives by up to NUM\n\
@@ -778,78 +1459,462 @@ size_t strtopos(const char *string, const char *message)
   return size;
 }
 
-// return true if s[0..n-1] contains a \0 (NUL) or a non-displayable invalid UTF-8 sequence
-bool is_binary(const char *s, size_t n)
+// case-fold an ASCII letter or the UTF-8 continuation byte of a Latin-1 letter after the lead byte prev, the Latin-1 letters U+00C0 to
+// U+00DE share the UTF-8 lead byte 0xc3 with their lower case U+00E0 to U+00FE, except U+00D7 and U+00F7
+inline uint8_t fold_byte(uint8_t b, uint8_t prev)
 {
-  const char *e = s + n;
-  while (s < e)
-  {
-    int8_t c;
-    while (s < e && (c = static_cast<int8_t>(*s)) > 0)
-      ++s;
-    if (s++ >= e)
-      break;
-    // U+0080 ~ U+07ff <-> c2 80 ~ df bf (disallow 2 byte overlongs)
-    if (c < -62 || c > -12 || s >= e || (*s++ & 0xc0) != 0x80)
-      return true;
-    // U+0800 ~ U+ffff <-> e0 a0 80 ~ ef bf bf (quick but allows surrogates and 3 byte overlongs)
-    if (c >= -32 && (s >= e || (*s++ & 0xc0) != 0x80))
-      return true;
-    // U+010000 ~ U+10ffff <-> f0 90 80 80 ~ f4 8f bf bf (quick but allows 4 byte overlongs)
-    if (c >= -16 && (s >= e || (*s++ & 0xc0) != 0x80))
-      return true;
-  }
-  return false;
+  return static_cast<uint8_t>(b + (((static_cast<uint8_t>(b - 'A') < 26) | (prev == 0xc3 && static_cast<uint8_t>(b - 0x80) < 0x1f && b != 0x97)) << 5));
 }
 
-// prime 61 mod 2^16 file indexing hash function
-inline uint32_t indexhash(uint32_t h, uint8_t b)
+// case-fold the ASCII letters and the Latin-1 letters encoded in UTF-8 of s[0..n-1] into t[0..n-1] with --ignore-case, where prev is the
+// byte before s[0] or zero, the loop over s[i] and s[i - 1] is vectorized by the compiler
+inline void fold_case(uint8_t *t, const uint8_t *s, size_t n, uint8_t prev)
 {
-  return static_cast<uint16_t>((h << 6) - h - h - h + b);
+  if (n == 0)
+    return;
+
+  t[0] = fold_byte(s[0], prev);
+  for (size_t i = 1; i < n; ++i)
+    t[i] = fold_byte(s[i], s[i - 1]);
 }
 
-// index a file to produce hashes[0..hashes_size-1] table, noise, and archive/binary file detection flags
-bool index(Stream& stream, const char *pathname, uint8_t *hashes, size_t& hashes_size, float& noise, bool& compressed, bool& archive, bool& binary, uint64_t& size)
+// hash the windows into hashes[0..mask] with the selected kernel, or with wide hashes when the table is larger than 64KB, with --ignore-case
+// hash the case-folded windows, where prev is the byte before window[0] or zero
+inline void hash_windows(uint8_t *hashes, uint32_t mask, const uint8_t *window, size_t n, uint8_t prev)
 {
-  hashes_size = 0;
-  noise = 0;
-  size = 0;
-  compressed = false;
-  binary = false;
+  uint8_t folded[BUF_SIZE + WIN_SIZE];
 
-  // open next file when not currently indexing an archive, return false when failed
-  if (!archive)
-    if (!stream.open(pathname))
-      return false;
+  while (n > 0)
+  {
+    size_t len = n;
+    const uint8_t *bytes = window;
 
-#ifdef HAVE_LIBZ
+    if (flag_ignore_case)
+    {
+      len = std::min<size_t>(n, BUF_SIZE);
+      fold_case(folded, window, len + WIN_SIZE - 1, prev);
+      prev = window[len - 1];
+      bytes = folded;
+    }
 
-  stream.read_next_file(pathname, archive);
+    if (mask > 0xffff)
+      hash_windows_wide(hashes, mask, bytes, len);
+    else
+      kernel->hash_windows(hashes, mask, bytes, len);
 
-#else
+    window += len;
+    n -= len;
+  }
+}
 
-  stream.input = stream.file;
+// hash the n-grams of the last window[0..n-1] truncated at the end of a file into hashes[0..mask], where prev is the byte before window[0] or zero,
+// only the n-grams that start at window[0..m-1] are hashed when m < n
+inline void hash_last_window(uint8_t *hashes, uint32_t mask, const uint8_t *window, size_t n, uint8_t prev, size_t m = SIZE_MAX)
+{
+  uint8_t folded[WIN_SIZE];
 
-#endif
+  if (flag_ignore_case)
+  {
+    fold_case(folded, window, n, prev);
+    window = folded;
+  }
 
-  char buffer[BUF_SIZE + WIN_SIZE]; // reserve WIN_SIZE (8) bytes padding for the window[] shifts
-  size_t buflen = stream.input.get(buffer, BUF_SIZE);
+  m = std::min(m, n);
+  for (size_t i = 0; i < m; ++i)
+  {
+    uint32_t h = window[i];
+    hashes[h & mask] &= ~0x01;
+    for (size_t j = i + 1, k = 0x02; j < n; ++j, k <<= 1)
+    {
+      h = indexhash_wide(h, window[j]);
+      hashes[h & mask] &= ~k;
+    }
+  }
+}
 
-#ifdef HAVE_LIBZ
+// the distinct trigrams of a file collected with --trigrams, a bitmap of all 2^24 trigrams and the list of the trigrams added to clear the bitmap
+struct TrigramSet {
 
-  if (flag_decompress)
+  TrigramSet()
+    :
+      bits(new uint64_t[(1 << 24) / 64]())
+  { }
+
+  // add the trigrams starting at s[0..n-1], case-folded with --ignore-case, where prev is the byte before s[0] or zero, note that s[0..n+1] must be valid
+  void add(const uint8_t *s, size_t n, uint8_t prev)
   {
-    // now that we have some data, are we extracting it from an archive with parts?
-    if (!stream.partname.empty())
+    if (n == 0)
+      return;
+
+    if (flag_ignore_case)
     {
-      // found an archive, do not close the pipe until all parts were extracted
-      archive = true;
+      uint32_t gram = (fold_byte(s[0], prev) << 8) | fold_byte(s[1], s[0]);
+      for (size_t i = 2; i < n + 2; ++i)
+        insert(gram = ((gram << 8) | fold_byte(s[i], s[i - 1])) & 0xffffff);
+    }
+    else
+    {
+      uint32_t gram = (s[0] << 8) | s[1];
+      for (size_t i = 2; i < n + 2; ++i)
+        insert(gram = ((gram << 8) | s[i]) & 0xffffff);
+    }
+  }
+
+  // add a trigram when not already added
+  void insert(uint32_t gram)
+  {
+    uint64_t& word = bits[gram >> 6];
+    uint64_t bit = static_cast<uint64_t>(1) << (gram & 63);
+    if ((word & bit) == 0)
+    {
+      word |= bit;
+      grams.push_back(gram);
+    }
+  }
+
+  // clear the set by clearing the words of the bitmap with the trigrams added, or the whole bitmap when most words are set
+  void clear()
+  {
+    if (grams.size() >= (1 << 24) / 64)
+      memset(bits.get(), 0, (1 << 24) / 8);
+    else
+      for (uint32_t gram : grams)
+        bits[gram >> 6] = 0;
+    grams.clear();
+  }
+
+  std::unique_ptr<uint64_t[]> bits;  // the bitmap of the trigrams added
+  std::vector<uint32_t>       grams; // the trigrams added, in the order added
+
+};
+
+// the file descriptor of a plain file that is not decompressed and not converted from UTF-16/32, or -1
+int plain_file(Stream& stream)
+{
+  if (flag_decompress || stream.block != NULL)
+    return -1;
+
+  if (stream.fd >= 0)
+    return stream.fd;
+
+  if (stream.file != NULL && stream.input.file() == stream.file && stream.input.file_encoding() == reflex::Input::file_encoding::plain)
+    return fileno(stream.file);
+
+  return -1;
+}
+
+// the size of the hashes table to index a file, with --hash-bits a plain file larger than WIDE_RATIO * 64KB gets a table of up to 2^BITS bytes
+size_t wide_table_size(Stream& stream, bool compressed, bool archive)
+{
+  if (flag_hash_bits <= 16 || compressed || archive || stream.block != NULL)
+    return 65536;
+
+  int fd;
+  if (stream.fd >= 0)
+    fd = stream.fd;
+  else if (stream.file != NULL)
+    fd = fileno(stream.file);
+  else
+    return 65536;
+
+  uint64_t wide_size = file_size(fd) / WIDE_RATIO;
+  size_t hashes_size = 65536;
+  while (hashes_size < wide_size && hashes_size < (static_cast<size_t>(1) << flag_hash_bits))
+    hashes_size *= 2;
+  return hashes_size;
+}
+
+// hash the n-grams at positions [start,end) of a file into hashes[0..hashes_size-1], reading WIN_SIZE bytes beyond the end to hash the n-grams across the end of the range, the last range ends at the end of the file
+bool hash_range(const char *pathname, uint64_t start, uint64_t end, bool last, uint8_t *hashes, size_t hashes_size, uint64_t& size)
+{
+  const uint32_t mask = static_cast<uint32_t>(hashes_size - 1);
+
+  FILE *file = NULL;
+
+  size = 0;
+
+  if (fopenw_s(&file, pathname, "rb") != 0)
+    return false;
+
+  if (flag_no_cache)
+    no_cache(fileno(file));
+
+  // read the byte before the range to case-fold the first window with --ignore-case
+  int prev = 0;
+  if (fseeko(file, static_cast<off_t>(start > 0 ? start - 1 : 0), SEEK_SET) != 0 || (start > 0 && (prev = fgetc(file)) == EOF))
+  {
+    fclose(file);
+    return false;
+  }
+
+  std::unique_ptr<char[]> buffer(new char[BUF_SIZE + WIN_SIZE]);
+  uint8_t *window = reinterpret_cast<uint8_t*>(buffer.get());
+  uint64_t remaining = last ? UINT64_MAX : end - start + WIN_SIZE;
+  size_t buflen = 0;
+  size_t len;
+
+  while (remaining > 0 && (len = fread(buffer.get() + buflen, 1, static_cast<size_t>(std::min<uint64_t>(BUF_SIZE + WIN_SIZE - buflen, remaining)), file)) > 0)
+  {
+    remaining -= len;
+    buflen += len;
+    size += len;
+
+    // hash the windows, keep the last WIN_SIZE bytes to hash with the next bytes read
+    if (buflen > WIN_SIZE)
+    {
+      hash_windows(hashes, mask, window, buflen - WIN_SIZE, static_cast<uint8_t>(prev));
+      prev = window[buflen - WIN_SIZE - 1];
+      memmove(window, window + buflen - WIN_SIZE, WIN_SIZE);
+      buflen = WIN_SIZE;
+    }
+  }
+
+  if (flag_no_cache)
+    drop_cache(fileno(file), start, size);
+
+  fclose(file);
+
+  if (last)
+  {
+    // hash the n-grams of the last window truncated at the end of the file, like index()
+    hash_last_window(hashes, mask, window, buflen, static_cast<uint8_t>(prev));
+  }
+  else
+  {
+    size = std::min(size, end - start);
+  }
+
+  return true;
+}
+
+// hash the windows of a mapped file at [start,end) into hashes[0..hashes_size-1] and the last window when last is true, returns false when the file was truncated while mapped
+bool hash_mapped(const uint8_t *map, uint64_t file_size, uint64_t start, uint64_t end, bool last, uint8_t *hashes, size_t hashes_size, uint64_t& size)
+{
+  const uint32_t mask = static_cast<uint32_t>(hashes_size - 1);
+
+  size = 0;
+
+#if !defined(OS_WIN)
+  // a page of the mapping beyond the end of a truncated file raises SIGBUS that jumps back here
+  sigjmp_buf jmp;
+  if (sigsetjmp(jmp, 1) != 0)
+  {
+    sigbus_jmp = NULL;
+    return false;
+  }
+  sigbus_jmp = &jmp;
+#endif
+
+  if (last)
+  {
+    // hash the windows up to the last window, then the n-grams of the last window truncated at the end of the file, like index()
+    const uint8_t *window = map + file_size - WIN_SIZE;
+    hash_windows(hashes, mask, map + start, static_cast<size_t>(file_size - WIN_SIZE - start), start > 0 ? map[start - 1] : 0);
+    hash_last_window(hashes, mask, window, WIN_SIZE, file_size > WIN_SIZE ? window[-1] : 0);
+    size = file_size - start;
+  }
+  else
+  {
+    // the windows of the range extend WIN_SIZE - 1 bytes into the next range
+    hash_windows(hashes, mask, map + start, static_cast<size_t>(end - start), start > 0 ? map[start - 1] : 0);
+    size = end - start;
+  }
+
+#if !defined(OS_WIN)
+  sigbus_jmp = NULL;
+#endif
+
+  return true;
+}
+
+// hash a large plain file from a memory mapping and in ranges in parallel into private tables that are AND-merged into hashes[0..hashes_size-1], returns false when the file should be hashed sequentially
+bool hash_ranges(Stream& stream, const char *pathname, uint8_t *hashes, size_t hashes_size, uint64_t& size)
+{
+  // only plain files that are not decompressed and not converted from UTF-16/32 have ranges of bytes to hash
+  int fd = plain_file(stream);
+  if (fd < 0)
+    return false;
+
+  uint64_t file_size = ::file_size(fd);
+  size_t num_threads = flag_jobs > 0 ? flag_jobs : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  size_t num_ranges = static_cast<size_t>(std::min<uint64_t>(num_threads, file_size / RANGE_SIZE));
+
+  // take up to num_ranges - 1 range threads from the budget of num_threads range threads shared by the workers, so workers hashing
+  // large files in parallel do not run num_threads range threads each with a table of hashes_size bytes
+  size_t extra = 0;
+  if (num_ranges > 1)
+  {
+    size_t running = range_threads.load();
+    do
+      extra = std::min(num_ranges - 1, num_threads - std::min(running, num_threads));
+    while (!range_threads.compare_exchange_weak(running, running + extra));
+  }
+
+  // hash a large file directly from a memory mapping, without copying the file into buffers
+  const uint8_t *map = file_size >= MMAP_SIZE ? map_file(fd, file_size) : NULL;
+
+  if (map == NULL && extra == 0)
+    return false;
+
+  num_ranges = extra + 1;
+
+  uint64_t range_size = file_size / num_ranges;
+  std::vector<std::unique_ptr<uint8_t[]>> tables(num_ranges);
+  std::vector<uint64_t> sizes(num_ranges);
+  std::vector<char> ok(num_ranges);
+  std::vector<std::thread> threads;
+
+  // hash range i from the mapping or by reading the range
+  auto hash = [&](size_t i, uint8_t *table) {
+    bool last = i + 1 == num_ranges;
+    uint64_t start = i * range_size;
+    uint64_t end = last ? file_size : start + range_size;
+    if (map != NULL)
+      ok[i] = hash_mapped(map, file_size, start, end, last, table, hashes_size, sizes[i]);
+    else
+      ok[i] = hash_range(pathname, start, end, last, table, hashes_size, sizes[i]);
+  };
+
+  // hash the first range into hashes[] with this thread and the other ranges into private tables with new threads
+  for (size_t i = 1; i < num_ranges; ++i)
+  {
+    tables[i].reset(new uint8_t[hashes_size]);
+    memset(tables[i].get(), 0xff, hashes_size);
+    threads.emplace_back(hash, i, tables[i].get());
+  }
+
+  hash(0, hashes);
+
+  for (auto& thread : threads)
+    thread.join();
+
+  range_threads -= extra;
+
+  if (map != NULL)
+    unmap_file(map, file_size);
+
+  if (std::find(ok.begin(), ok.end(), false) != ok.end())
+  {
+    // failed or truncated, clear the table to hash the file sequentially
+    memset(hashes, 0xff, hashes_size);
+    return false;
+  }
+
+  // Bloom filters are merged by AND because zero bits are hits
+  size = sizes[0];
+  for (size_t i = 1; i < num_ranges; ++i)
+  {
+    const uint8_t *table = tables[i].get();
+    for (size_t j = 0; j < hashes_size; ++j)
+      hashes[j] &= table[j];
+    size += sizes[i];
+  }
+
+  return true;
+}
+
+// fold the hashes table in place to the smallest table size until the given accuracy max noise is reached or exceeded, returns the noise of the table
+void fold_table(uint8_t *hashes, size_t& hashes_size, float& noise)
+{
+  const unsigned max_noise = noise_percentage(flag_accuracy);
+
+  // count the zero bits (hits) of the table and of the table halved down to MIN_SIZE in one pass, a table larger than 64KB is halved
+  // in passes of up to log2(FOLD_MAX_ROWS) levels and folded between passes
+  size_t zeros[FOLD_MAX_LEVELS + 1];
+  size_t fold_size = hashes_size;
+  while (true)
+  {
+    size_t min_size = std::max<size_t>(MIN_SIZE, fold_size / FOLD_MAX_ROWS);
+    kernel->fold_levels(hashes, fold_size, min_size, zeros);
+
+    // noise is the fraction of zero bits (hits) in the table
+    if (fold_size == hashes_size)
+    {
+      noise = static_cast<float>(zeros[0]);
+      noise /= 8 * hashes_size;
+    }
+
+    // pick the smallest table size until the given accuracy max noise is reached or exceeded
+    for (size_t level = 1; fold_size > min_size; ++level)
+    {
+      // noise of halved hashes table (zero bits are hits)
+      size_t half = fold_size / 2;
+      float half_noise = static_cast<float>(zeros[level]);
+
+      half_noise /= 8 * half;
+
+      // stop at desired accuracy
+      if (100.0 * half_noise >= max_noise)
+        break;
+
+      fold_size = half;
+      noise = half_noise;
+    }
+
+    // compress hashes table in place
+    if (fold_size < hashes_size)
+    {
+      kernel->fold(hashes, hashes_size, fold_size);
+      hashes_size = fold_size;
+    }
+
+    // continue with the next pass when the table was halved down to the smallest size of this pass
+    if (fold_size > min_size || fold_size == MIN_SIZE)
+      break;
+  }
+}
+
+// index a file to produce hashes[0..hashes_size-1] table, noise, and archive/binary file detection flags, and the tables of the blocks of a large file with --blocks
+bool index(Stream& stream, const char *pathname, uint8_t *hashes, size_t& hashes_size, float& noise, bool& compressed, bool& archive, bool& binary, uint64_t& size, std::vector<std::vector<uint8_t>>& blocks, TrigramSet *trigrams)
+{
+  hashes_size = 0;
+  noise = 0;
+  size = 0;
+  compressed = false;
+  binary = false;
+  blocks.clear();
+
+  if (stream.block != NULL)
+  {
+    // index the file read ahead into a block by a reader
+    stream.input = reflex::Input(stream.block->data, stream.block->size);
+  }
+  else
+  {
+    // open next file when not currently indexing an archive, return false when failed
+    if (!archive)
+      if (!stream.open(pathname))
+        return false;
+
+#ifdef HAVE_LIBZ
+
+    stream.read_next_file(pathname, archive);
+
+#else
+
+    stream.input = stream.file;
+
+#endif
+  }
+
+  char buffer[BUF_SIZE + WIN_SIZE]; // reserve WIN_SIZE (8) bytes padding for the window[] shifts
+  size_t buflen = stream.get(buffer, BUF_SIZE);
+
+#ifdef HAVE_LIBZ
+
+  if (flag_decompress)
+  {
+    // now that we have some data, are we extracting it from an archive with parts?
+    if (!stream.partname.empty())
+    {
+      // found an archive, do not close the pipe until all parts were extracted
+      archive = true;
 
 #ifndef WITH_DECOMPRESSION_THREAD
       // if extracting a directory part in an archive, then read it to skip it (decompression thread does this automatically)
       if (stream.partname.back() == '/')
       {
-        while (stream.input.get(buffer, BUF_SIZE) != 0)
+        while (stream.get(buffer, BUF_SIZE) != 0)
           continue;
         return true;
       }
@@ -861,7 +1926,7 @@ bool index(Stream& stream, const char *pathname, uint8_t *hashes, size_t& hashes
         // ignore hidden files and directories in archives by skipping them (but ugrep will never find them!)
         if (stream.partname.find("/.") != std::string::npos)
         {
-          while (stream.input.get(buffer, BUF_SIZE) != 0)
+          while (stream.get(buffer, BUF_SIZE) != 0)
             continue;
           return true;
         }
@@ -899,14 +1964,14 @@ bool index(Stream& stream, const char *pathname, uint8_t *hashes, size_t& hashes
     if ((buffer[checklen] & 0xc0) != 0xc0)
       binary = true;
   }
-  binary = binary || is_binary(buffer, checklen);
+  binary = binary || kernel->is_binary(buffer, checklen);
 
   if (binary && flag_ignore_binary)
   {
     // if extracting a binary archive part, then read it to skip it
     if (archive)
     {
-      while (stream.input.get(buffer, BUF_SIZE) != 0)
+      while (stream.get(buffer, BUF_SIZE) != 0)
         continue;
     }
     else
@@ -918,116 +1983,2055 @@ bool index(Stream& stream, const char *pathname, uint8_t *hashes, size_t& hashes
   }
 
   const unsigned max_noise = noise_percentage(flag_accuracy);
+
+  // read the rest of a short file into the buffer to index a small file with a smaller table
+  bool eof = false;
+  if (buflen < BUF_SIZE)
+  {
+    size_t len;
+    while (buflen < BUF_SIZE && (len = stream.get(buffer + buflen, BUF_SIZE - buflen)) > 0)
+      buflen += len;
+    eof = buflen < BUF_SIZE;
+  }
+
   const uint8_t *window = reinterpret_cast<uint8_t*>(buffer);
   size_t winlen = std::min(buflen, WIN_SIZE);
   size = buflen;
   buflen -= winlen;
-  hashes_size = 65536;
-  memset(hashes, 0xff, hashes_size);
+  hashes_size = eof ? 65536 : wide_table_size(stream, compressed, archive);
+
+  if (eof)
+  {
+    // the number of n-grams of a small file bounds the number of zero bits (hits) of the table at every fold level, when the noise of the
+    // halved table is bounded below max noise then hash directly into the halved table, saving the time to clear, count and fold the table
+    size_t grams = size >= WIN_SIZE ? 8 * size - 28 : size * (size + 1) / 2;
+    while (hashes_size > MIN_SIZE)
+    {
+      size_t half = hashes_size / 2;
+      float max_half_noise = static_cast<float>(grams);
+
+      max_half_noise /= 8 * half;
+
+      if (100.0 * max_half_noise >= max_noise)
+        break;
+
+      hashes_size = half;
+    }
+  }
+
+  const uint32_t mask = static_cast<uint32_t>(hashes_size - 1);
+  if (trigrams == NULL)
+    memset(hashes, 0xff, hashes_size);
+
+  // with --blocks a plain file larger than the block size is indexed in blocks with a table of the n-grams that start in the block,
+  // the first block is hashed into hashes[] and the next blocks into a table that is AND-merged into hashes[] at the end of a block
+  uint64_t block_size = 0;
+  if (flag_blocks > 0 && !eof && !compressed && !archive && trigrams == NULL)
+  {
+    int fd = plain_file(stream);
+    if (fd >= 0 && file_size(fd) > 1048576 * static_cast<uint64_t>(flag_blocks))
+      block_size = 1048576 * static_cast<uint64_t>(flag_blocks);
+  }
+  uint64_t block_end = block_size; // the position of the first window of the next block
+  uint64_t position = 0;           // the position of the next window to hash
+  uint8_t *table = hashes;         // the table of the current block
+  uint8_t prev = 0;                // the byte before the next window to hash, to case-fold with --ignore-case
+  std::unique_ptr<uint8_t[]> block;
+
+  // end the current block, fold a copy of its table to the accuracy and start the next block
+  auto end_block = [&]() {
+    if (!block)
+    {
+      block.reset(new uint8_t[hashes_size]);
+      table = block.get();
+      blocks.emplace_back(hashes, hashes + hashes_size);
+    }
+    else
+    {
+      blocks.emplace_back(table, table + hashes_size);
+      for (size_t j = 0; j < hashes_size; ++j)
+        hashes[j] &= table[j];
+    }
+    size_t block_hashes_size = hashes_size;
+    float block_noise;
+    fold_table(blocks.back().data(), block_hashes_size, block_noise);
+    blocks.back().resize(block_hashes_size);
+    memset(table, 0xff, hashes_size);
+  };
+
+  // hash a large file from a memory mapping and in ranges in parallel instead of sequentially, unless indexed in blocks or collecting trigrams
+  if (!eof && block_size == 0 && trigrams == NULL && hash_ranges(stream, pathname, hashes, hashes_size, size))
+    buflen = winlen = 0;
 
   if (buflen > 0)
   {
     while (true)
     {
-      // compute 8 staggered Bloom filters, hashing 1-grams to 8-grams for N^2 = 64 Bloom hash functions
-      uint32_t h = window[0];
-      hashes[h] &= ~0x01;
-      h = indexhash(h, window[1]);
-      hashes[h] &= ~0x02;
-      h = indexhash(h, window[2]);
-      hashes[h] &= ~0x04;
-      h = indexhash(h, window[3]);
-      hashes[h] &= ~0x08;
-      h = indexhash(h, window[4]);
-      hashes[h] &= ~0x10;
-      h = indexhash(h, window[5]);
-      hashes[h] &= ~0x20;
-      h = indexhash(h, window[6]);
-      hashes[h] &= ~0x40;
-      h = indexhash(h, window[7]);
-      hashes[h] &= ~0x80;
+      // end the blocks at the block boundaries in the windows to hash
+      while (block_size > 0 && position + buflen > block_end)
+      {
+        size_t len = static_cast<size_t>(block_end - position);
+        hash_windows(table, mask, window, len, prev);
+        prev = len > 0 ? window[len - 1] : prev;
+        window += len;
+        buflen -= len;
+        position = block_end;
+        block_end += block_size;
+        end_block();
+      }
+
+      // compute 8 staggered Bloom filters, hashing 1-grams to 8-grams for N^2 = 64 Bloom hash functions, or collect the trigrams with --trigrams
+      if (trigrams != NULL)
+        trigrams->add(window, buflen, prev);
+      else
+        hash_windows(table, mask, window, buflen, prev);
+      prev = buflen > 0 ? window[buflen - 1] : prev;
+      position += buflen;
 
       // shift window
-      ++window;
-      --buflen;
+      window += buflen;
+
+      // we got the whole file
+      if (eof)
+        break;
 
-      // refill buffer[] when empty
+      // move the remainder of the last window to the front of the buffer[] and append
+      memmove(buffer, window, WIN_SIZE);
+      buflen = stream.get(buffer + WIN_SIZE, BUF_SIZE);
+      window = reinterpret_cast<uint8_t*>(buffer);
       if (buflen == 0)
-      {
-        // move the remainder of the last window to the front of the buffer[] and append
-        memmove(buffer, window, WIN_SIZE);
-        buflen = stream.input.get(buffer + WIN_SIZE, BUF_SIZE);
-        window = reinterpret_cast<uint8_t*>(buffer);
-        if (buflen == 0)
-          break;
-        size += buflen;
-      }
+        break;
+      size += buflen;
     }
   }
 
-  for (size_t i = 0; i < winlen; ++i)
+  // end the block at the block boundary in the last window, when the file is only slightly larger than the block size
+  if (block_size > 0 && position + winlen > block_end)
   {
-    uint32_t h = window[i];
-    hashes[h] &= ~0x01;
-    for (size_t j = i + 1, k = 0x02; j < winlen; ++j, k <<= 1)
-    {
-      h = indexhash(h, window[j]);
-      hashes[h] &= ~k;
-    }
+    size_t len = static_cast<size_t>(block_end - position);
+    hash_last_window(table, mask, window, winlen, prev, len);
+    prev = len > 0 ? window[len - 1] : prev;
+    window += len;
+    winlen -= len;
+    end_block();
   }
 
+  if (trigrams != NULL)
+    trigrams->add(window, winlen > 2 ? winlen - 2 : 0, prev);
+  else
+    hash_last_window(table, mask, window, winlen, prev);
+
   if (!archive)
     stream.close();
 
-  for (size_t i = 0; i < hashes_size; ++i)
+  // the trigrams collected replace the hashes table
+  if (trigrams != NULL)
   {
-    noise += (hashes[i] & 0x01) == 0;
-    noise += (hashes[i] & 0x02) == 0;
-    noise += (hashes[i] & 0x04) == 0;
-    noise += (hashes[i] & 0x08) == 0;
-    noise += (hashes[i] & 0x10) == 0;
-    noise += (hashes[i] & 0x20) == 0;
-    noise += (hashes[i] & 0x40) == 0;
-    noise += (hashes[i] & 0x80) == 0;
+    hashes_size = 0;
+    return true;
   }
 
-  noise /= 8 * hashes_size;
+  // the last block has the n-grams up to the end of the file, the table of the file is the AND of the tables of its blocks
+  if (!blocks.empty())
+    end_block();
+
+  // pick the smallest table size until the given accuracy max noise is reached or exceeded
+  fold_table(hashes, hashes_size, noise);
+
+  return true;
+}
+
+// an indexed file or archive part with its hashes table, produced by a worker
+struct Part {
+
+  Part()
+    :
+      noise(0),
+      size(0),
+      compressed(false),
+      archive(false),
+      binary(false)
+  { }
+
+  std::string          partname;   // name of the archive part
+  std::vector<uint8_t> hashes;     // hashes table, empty to skip empty files and binary files when -I is specified
+  std::vector<std::vector<uint8_t>> blocks; // the hashes tables of the blocks of a large file indexed in blocks with --blocks
+  std::vector<uint32_t> trigrams;  // the distinct trigrams of the file or archive part with --trigrams
+  float                noise;      // noise of the hashes table
+  uint64_t             size;       // file size
+  bool                 compressed; // compressed file
+  bool                 archive;    // archive part
+  bool                 binary;     // binary file
+
+};
+
+// a file to index by a worker, the indexed parts are written to the index file by the main thread in the order of the jobs
+struct Job {
+
+  Job(const Entry& entry)
+    :
+      entry(entry),
+      read(true),
+      failed(false),
+      done(false)
+  { }
+
+  Entry                  entry;  // the file to index
+  std::unique_ptr<Block> block;  // the file read ahead by a reader
+  std::deque<Part>       parts;  // indexed parts produced by the worker and consumed by the main thread
+  bool                   read;   // false until a reader has read the file ahead into the block
+  bool                   failed; // true when the file cannot be indexed
+  bool                   done;   // true when the worker is done with this job
+
+};
+
+// store a 32 bit little-endian integer in a format 4 index file
+inline void store32(uint8_t *p, uint32_t x)
+{
+  p[0] = static_cast<uint8_t>(x);
+  p[1] = static_cast<uint8_t>(x >> 8);
+  p[2] = static_cast<uint8_t>(x >> 16);
+  p[3] = static_cast<uint8_t>(x >> 24);
+}
+
+// store a 64 bit little-endian integer in a format 4 index file
+inline void store64(uint8_t *p, uint64_t x)
+{
+  store32(p, static_cast<uint32_t>(x));
+  store32(p + 4, static_cast<uint32_t>(x >> 32));
+}
+
+// load a 32 bit little-endian integer from a format 4 index file
+inline uint32_t load32(const uint8_t *p)
+{
+  return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+// load a 64 bit little-endian integer from a format 4 index file
+inline uint64_t load64(const uint8_t *p)
+{
+  return static_cast<uint64_t>(load32(p)) | (static_cast<uint64_t>(load32(p + 4)) << 32);
+}
+
+// hashes table size of a record with log2 of the table size in the low 5 bits of flags, zero to skip empty files and binary files when -I is specified
+inline size_t table_size(uint8_t flags)
+{
+  size_t hashes_size = 0;
+  uint8_t logsize = flags & 0x1f;
+  if (logsize > 0)
+    for (hashes_size = 1; logsize > 0; --logsize)
+      hashes_size <<= 1;
+  return hashes_size;
+}
+
+// the hashes table of a block of a file indexed in blocks with --blocks
+struct BlockTable {
+
+  BlockTable(const uint8_t *hashes, size_t hashes_size)
+    :
+      hashes(hashes),
+      hashes_size(hashes_size)
+  { }
+
+  const uint8_t *hashes;      // hashes table of the block
+  size_t         hashes_size; // hashes table size
+
+};
+
+// a record of an index file in format 3 or 4 read into memory, to reconcile with the directory contents
+struct Record {
+
+  uint8_t        header[4];   // accuracy digit or zero for a tombstone, log2 of the hashes table size with flags, basename size
+  std::string    basename;    // file basename
+  const uint8_t *hashes;      // hashes table in the index file read into memory
+  std::shared_ptr<std::string> table; // the hashes table gathered from the bit slices of a format 4 index file, owns hashes
+  size_t         hashes_size; // hashes table size
+  size_t         offset;      // offset of a format 3 record in the index file
+  size_t         size;        // size of the record in format 3
+  uint64_t       block_size;  // the block size of a file indexed in blocks in a format 4 index file
+  std::vector<BlockTable> blocks; // the hashes tables of the blocks of the file in the index file read into memory
+
+};
+
+// an entry of the table of contents of a format 4 index file
+struct TocEntry {
 
-  // compress the table in place until the given accuracy max noise is reached or exceeded
-  while (hashes_size > MIN_SIZE)
+  TocEntry(const uint8_t *header, const char *basename, size_t basename_size, uint64_t offset)
+    :
+      basename(basename, basename_size),
+      accuracy(header[0]),
+      flags(header[1]),
+      offset(offset),
+      lane(0),
+      block_size(0),
+      blocks(0),
+      num_blocks(0)
+  { }
+
+  std::string basename;   // file basename
+  uint8_t     accuracy;   // accuracy digit
+  uint8_t     flags;      // log2 of the hashes table size with compressed, archive and binary flags
+  uint64_t    offset;     // offset of the hashes table in the index file, or of the group of bit-sliced tables, zero when the table is empty
+  uint16_t    lane;       // the bit of the file in the group of bit-sliced tables
+  uint64_t    block_size; // the block size of a file indexed in blocks with --blocks, zero otherwise
+  uint64_t    blocks;     // offset of the list of the offsets and sizes of the hashes tables of the blocks
+  uint32_t    num_blocks; // the number of blocks
+
+};
+
+// return the format of an index file, 3 or 4, or 0 when the file is not an index file, and the width of the groups of bit-sliced tables of a format 4 index file or 0
+int index_format(const char *filename, size_t& slices)
+{
+  FILE *file = NULL;
+  uint8_t header[V4_HEADER_SIZE];
+  int format = 0;
+
+  slices = 0;
+
+  if (fopenw_s(&file, filename, "rb") == 0)
   {
-    // compute noise of halved hashes table (zero bits are hits)
-    size_t half = hashes_size / 2;
-    float half_noise = 0;
+    size_t size = fread(header, 1, sizeof(header), file);
+
+    if (size >= sizeof(ugrep_index_file_magic))
+    {
+      if (memcmp(header, ugrep_index_file_magic, sizeof(ugrep_index_file_magic)) == 0)
+        format = 3;
+      else if (memcmp(header, ugrep_index_file_magic_v4, sizeof(ugrep_index_file_magic_v4)) == 0)
+        format = 4;
+    }
+
+    if (format == 4 && size == sizeof(header))
+      slices = load32(header + 36);
+
+    fclose(file);
+  }
+
+  return format;
+}
+
+// read the records of an index file in format 3 or 4 read into index[0..index_size-1], returns the format or 0 when not an index file, sets torn when the index file is cut short or corrupt
+int read_records(const uint8_t *index, size_t index_size, std::vector<Record>& records, bool& torn)
+{
+  torn = false;
+
+  if (index_size < sizeof(ugrep_index_file_magic))
+    return 0;
+
+  if (memcmp(index, ugrep_index_file_magic, sizeof(ugrep_index_file_magic)) == 0)
+  {
+    // format 3 is a sequence of header[4], basename and hashes table records
+    size_t pos = sizeof(ugrep_index_file_magic);
+
+    while (pos + 4 <= index_size)
+    {
+      Record record;
+      memcpy(record.header, index + pos, 4);
+
+      record.hashes_size = table_size(record.header[1]);
+
+      // sanity check
+      if (record.hashes_size > (static_cast<size_t>(1) << HASH_MAX_BITS))
+        break;
+
+      size_t basename_size = record.header[2] | (record.header[3] << 8);
+      record.offset = pos;
+      record.size = 4 + basename_size + record.hashes_size;
+
+      // a record cut short at the end of the index file is dropped
+      if (pos + record.size > index_size)
+        break;
+
+      record.basename.assign(reinterpret_cast<const char*>(index + pos + 4), basename_size);
+      record.hashes = index + pos + 4 + basename_size;
+      records.emplace_back(std::move(record));
+
+      pos += records.back().size;
+    }
+
+    torn = pos < index_size;
+
+    return 3;
+  }
+
+  if (memcmp(index, ugrep_index_file_magic_v4, sizeof(ugrep_index_file_magic_v4)) == 0)
+  {
+    // format 4 is a header, 64-byte aligned hashes tables and a table of contents of front-coded basenames sorted by basename
+    if (index_size < V4_HEADER_SIZE)
+    {
+      torn = true;
+      return 4;
+    }
+
+    uint32_t num_entries = load32(index + 8);
+    uint64_t toc_offset = load64(index + 16);
+    uint64_t toc_size = load64(index + 24);
+    uint32_t num_restarts = load32(index + 32);
+    uint32_t slices = load32(index + 36);
+    uint64_t directory_offset = load64(index + 40);
+    uint32_t num_groups = load32(index + 48);
+    uint32_t num_blocked = load32(index + 52);
+    uint64_t blocks_offset = load64(index + 56);
+
+    // the table of contents entries have a lane when the tables are bit-sliced
+    size_t entry_size = slices == 0 ? 14 : 16;
+
+    if (num_blocked > 0 &&
+        (blocks_offset > index_size ||
+         24 * static_cast<uint64_t>(num_blocked) > index_size - blocks_offset))
+    {
+      torn = true;
+      return 4;
+    }
+
+    // the directory of the files indexed in blocks by table of contents entry, with the block size and the list of the tables of the blocks
+    const uint8_t *blocked = index + blocks_offset;
+    const uint8_t *blocked_end = blocked + 24 * static_cast<size_t>(num_blocked);
+
+    if (slices > 0 &&
+        (slices >= SLICES_NONE ||
+         directory_offset > index_size ||
+         16 * static_cast<uint64_t>(num_groups) > index_size - directory_offset))
+    {
+      torn = true;
+      return 4;
+    }
+
+    // the directory of the groups of bit-sliced tables sorted by offset, with the number of files of each group
+    const uint8_t *directory = index + directory_offset;
+
+    if (toc_offset < V4_HEADER_SIZE ||
+        toc_offset > index_size ||
+        toc_size > index_size - toc_offset ||
+        4 * static_cast<uint64_t>(num_restarts) > toc_size)
+    {
+      torn = true;
+      return 4;
+    }
+
+    const uint8_t *toc = index + toc_offset + 4 * static_cast<size_t>(num_restarts);
+    const uint8_t *end = index + toc_offset + toc_size;
+    std::string basename;
+
+    for (uint32_t i = 0; i < num_entries; ++i)
+    {
+      if (static_cast<size_t>(end - toc) < entry_size)
+      {
+        torn = true;
+        break;
+      }
+
+      size_t prefix = toc[2] | (toc[3] << 8);
+      size_t suffix = toc[4] | (toc[5] << 8);
+      uint64_t offset = load64(toc + 6);
+      size_t lane = slices == 0 ? SLICES_NONE : toc[14] | (toc[15] << 8);
+
+      Record record;
+      record.hashes_size = table_size(toc[1]);
+
+      // the size of the row of a bit of the table in the group of bit-sliced tables of the file
+      size_t lanes = 0;
+      if (lane != SLICES_NONE && record.hashes_size > 0)
+      {
+        uint32_t lo = 0;
+        uint32_t hi = num_groups;
+        while (lo < hi)
+        {
+          uint32_t mid = (lo + hi) / 2;
+          if (load64(directory + 16 * mid) < offset)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+        if (lo < num_groups && load64(directory + 16 * lo) == offset && lane < load32(directory + 16 * lo + 12))
+          lanes = (load32(directory + 16 * lo + 12) + 63) / 64 * 8;
+        else
+          lane = SLICES_NONE + 1;
+      }
+
+      // the size of the group of bit-sliced tables or the size of the table
+      uint64_t size = lanes == 0 ? record.hashes_size : static_cast<uint64_t>(8 * record.hashes_size) * lanes;
+
+      // sanity check
+      if (prefix > basename.size() ||
+          prefix + suffix > 65535 ||
+          suffix > static_cast<size_t>(end - toc) - entry_size ||
+          record.hashes_size > (static_cast<size_t>(1) << HASH_MAX_BITS) ||
+          offset > index_size ||
+          size > index_size - offset ||
+          lane > SLICES_NONE)
+      {
+        torn = true;
+        break;
+      }
+
+      basename.resize(prefix);
+      basename.append(reinterpret_cast<const char*>(toc + entry_size), suffix);
+
+      record.header[0] = toc[0];
+      record.header[1] = toc[1];
+      record.header[2] = static_cast<uint8_t>(basename.size());
+      record.header[3] = static_cast<uint8_t>(basename.size() >> 8);
+      record.basename = basename;
+      record.hashes = index + offset;
+      record.offset = 0;
+      record.size = 4 + basename.size() + record.hashes_size;
+      record.block_size = 0;
+
+      // the tables of the blocks of the file, when indexed in blocks
+      if (blocked < blocked_end && load32(blocked) == i)
+      {
+        uint32_t num_blocks = load32(blocked + 4);
+        uint64_t list = load64(blocked + 16);
+
+        if (list > index_size || 16 * static_cast<uint64_t>(num_blocks) > index_size - list)
+        {
+          torn = true;
+          break;
+        }
+
+        record.block_size = load64(blocked + 8);
+
+        for (uint32_t j = 0; j < num_blocks; ++j)
+        {
+          uint64_t block_offset = load64(index + list + 16 * j);
+          uint64_t block_size = load64(index + list + 16 * j + 8);
+          if (block_size > (static_cast<size_t>(1) << HASH_MAX_BITS) || block_offset > index_size || block_size > index_size - block_offset)
+          {
+            torn = true;
+            break;
+          }
+          record.blocks.emplace_back(index + block_offset, static_cast<size_t>(block_size));
+        }
+
+        if (torn)
+          break;
+
+        blocked += 24;
+      }
+
+      // gather the bits of the file's lane from the group of bit-sliced tables
+      if (lanes > 0)
+      {
+        const uint8_t *group = index + offset;
+        record.table = std::make_shared<std::string>(record.hashes_size, '\0');
+        uint8_t *table = reinterpret_cast<uint8_t*>(&(*record.table)[0]);
+        for (size_t j = 0; j < 8 * record.hashes_size; ++j)
+          table[j >> 3] |= ((group[j * lanes + (lane >> 3)] >> (lane & 7)) & 1) << (j & 7);
+        record.hashes = table;
+      }
+
+      records.emplace_back(std::move(record));
+
+      toc += entry_size + suffix;
+    }
+
+    return 4;
+  }
+
+  return 0;
+}
+
+// the groups of bit-sliced hashes tables of a format 4 index file written with --slices=WIDTH, the tables of up to WIDTH files of the same size are transposed to store one bit per file per bit of the tables, to probe the files of a group at once
+struct Slices {
+
+  // the tables of the same size pending to be transposed and the table of contents entries of their files
+  struct Group {
+    std::vector<uint8_t> tables;
+    std::vector<size_t>  entries;
+  };
+
+  Slices(size_t width)
+    :
+      width(width),
+      num_groups(0)
+  { }
+
+  size_t      width;      // the number of files per group, a multiple of 64
+  Group       groups[17]; // the pending tables by log2 of the table size, tables larger than 64KB are not bit-sliced
+  std::string directory;  // the offset, table size and number of files of each group written
+  uint32_t    num_groups; // the number of groups written
+
+};
+
+// transpose an 8x8 bit matrix of 8 rows of 8 bits stored in the bytes of x
+inline uint64_t transpose8(uint64_t x)
+{
+  uint64_t t;
+  t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+  x = x ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+  x = x ^ t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+  x = x ^ t ^ (t << 28);
+  return x;
+}
+
+// transpose and write a group of tables of hashes_size bytes at the next aligned offset, bit j of the tables is stored in a row of 64-bit words with one bit per file, unused bits are 1 to never match
+bool write_v4_group(FILE *file, uint64_t& offset, std::vector<TocEntry>& toc, Slices& slices, Slices::Group& group, size_t hashes_size)
+{
+  static const uint8_t zeros[V4_ALIGN] = { 0 };
+
+  size_t num_files = group.entries.size();
+  size_t lanes = (num_files + 63) / 64 * 8;
+  std::vector<uint8_t> data(8 * hashes_size * lanes, 0xff);
+
+  // transpose the 8x8 bit blocks of byte b of 8 tables to bytes b * 8 + k of the slices of these 8 files
+  for (size_t b = 0; b < hashes_size; ++b)
+  {
+    for (size_t l = 0; 8 * l < num_files; ++l)
+    {
+      uint64_t x = 0;
+      for (size_t k = 0; k < 8; ++k)
+        x |= static_cast<uint64_t>(8 * l + k < num_files ? group.tables[(8 * l + k) * hashes_size + b] : 0xff) << (8 * k);
+      x = transpose8(x);
+      for (size_t k = 0; k < 8; ++k)
+        data[(8 * b + k) * lanes + l] = static_cast<uint8_t>(x >> (8 * k));
+    }
+  }
+
+  size_t padding = static_cast<size_t>((V4_ALIGN - offset % V4_ALIGN) % V4_ALIGN);
+
+  if (fwrite(zeros, 1, padding, file) < padding ||
+      fwrite(data.data(), 1, data.size(), file) < data.size())
+    return false;
+
+  uint64_t group_offset = offset + padding;
+  offset = group_offset + data.size();
+
+  for (size_t i = 0; i < num_files; ++i)
+  {
+    toc[group.entries[i]].offset = group_offset;
+    toc[group.entries[i]].lane = static_cast<uint16_t>(i);
+  }
+
+  uint8_t bytes[16];
+  store64(bytes, group_offset);
+  store32(bytes + 8, static_cast<uint32_t>(hashes_size));
+  store32(bytes + 12, static_cast<uint32_t>(num_files));
+  slices.directory.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+  ++slices.num_groups;
+
+  group.tables.clear();
+  group.entries.clear();
+
+  return true;
+}
+
+// begin writing a format 4 index file with a header that is written when the index file is complete
+bool begin_v4(FILE *file, uint64_t& offset)
+{
+  static const uint8_t zeros[V4_HEADER_SIZE] = { 0 };
+
+  offset = V4_HEADER_SIZE;
+
+  return fwrite(zeros, 1, V4_HEADER_SIZE, file) == V4_HEADER_SIZE;
+}
+
+// write the hashes table of a file to a format 4 index file at the next aligned offset and add the file to the table of contents, or add the table to its group of bit-sliced tables with --slices
+bool write_v4_table(FILE *file, uint64_t& offset, std::vector<TocEntry>& toc, const uint8_t *header, const char *basename, size_t basename_size, const uint8_t *hashes, size_t hashes_size, Slices *slices = NULL)
+{
+  static const uint8_t zeros[V4_ALIGN] = { 0 };
+
+  if (slices != NULL && hashes_size > 0 && hashes_size <= 65536)
+  {
+    Slices::Group& group = slices->groups[header[1] & 0x1f];
+    toc.emplace_back(header, basename, basename_size, 0);
+    group.entries.push_back(toc.size() - 1);
+    group.tables.insert(group.tables.end(), hashes, hashes + hashes_size);
+
+    return group.entries.size() < slices->width || write_v4_group(file, offset, toc, *slices, group, hashes_size);
+  }
+
+  uint64_t table_offset = 0;
+
+  if (hashes_size > 0)
+  {
+    size_t padding = static_cast<size_t>((V4_ALIGN - offset % V4_ALIGN) % V4_ALIGN);
+
+    if (fwrite(zeros, 1, padding, file) < padding ||
+        fwrite(hashes, 1, hashes_size, file) < hashes_size)
+      return false;
+
+    table_offset = offset + padding;
+    offset = table_offset + hashes_size;
+  }
+
+  toc.emplace_back(header, basename, basename_size, table_offset);
+
+  return true;
+}
+
+// write the hashes tables of the blocks of a file indexed in blocks with --blocks at the next aligned offsets followed by the list of their offsets and sizes, the list is linked to the table of contents entry of the file
+bool write_v4_blocks(FILE *file, uint64_t& offset, TocEntry& entry, uint64_t block_size, const std::vector<BlockTable>& blocks)
+{
+  static const uint8_t zeros[V4_ALIGN] = { 0 };
+
+  if (blocks.empty())
+    return true;
+
+  std::string list;
+  uint8_t bytes[16];
+
+  for (const BlockTable& block : blocks)
+  {
+    size_t padding = static_cast<size_t>((V4_ALIGN - offset % V4_ALIGN) % V4_ALIGN);
+
+    if (fwrite(zeros, 1, padding, file) < padding ||
+        fwrite(block.hashes, 1, block.hashes_size, file) < block.hashes_size)
+      return false;
+
+    store64(bytes, offset + padding);
+    store64(bytes + 8, block.hashes_size);
+    list.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+    offset += padding + block.hashes_size;
+  }
+
+  if (fwrite(list.data(), 1, list.size(), file) < list.size())
+    return false;
+
+  entry.block_size = block_size;
+  entry.blocks = offset;
+  entry.num_blocks = static_cast<uint32_t>(blocks.size());
+  offset += list.size();
+
+  return true;
+}
+
+// end writing a format 4 index file that starts at base with the groups of bit-sliced tables and their directory with --slices, the directory of the files indexed in blocks with --blocks and the table of contents sorted by basename, then write the header at base and seek to the end
+bool end_v4(FILE *file, uint64_t base, uint64_t offset, std::vector<TocEntry>& toc, Slices *slices = NULL)
+{
+  uint64_t directory_offset = 0;
+
+  if (slices != NULL)
+  {
+    static const uint8_t zeros[V4_ALIGN] = { 0 };
+
+    // write the groups that are not full, but write the tables of small groups separately, then write the directory of the groups
+    for (size_t i = 0; i < 17; ++i)
+    {
+      Slices::Group& group = slices->groups[i];
+      size_t hashes_size = table_size(static_cast<uint8_t>(i));
+
+      if (group.entries.size() >= SLICES_MIN)
+      {
+        if (!write_v4_group(file, offset, toc, *slices, group, hashes_size))
+          return false;
+      }
+      else
+      {
+        for (size_t j = 0; j < group.entries.size(); ++j)
+        {
+          size_t padding = static_cast<size_t>((V4_ALIGN - offset % V4_ALIGN) % V4_ALIGN);
+
+          if (fwrite(zeros, 1, padding, file) < padding ||
+              fwrite(group.tables.data() + j * hashes_size, 1, hashes_size, file) < hashes_size)
+            return false;
+
+          toc[group.entries[j]].offset = offset + padding;
+          toc[group.entries[j]].lane = SLICES_NONE;
+          offset += padding + hashes_size;
+        }
+      }
+    }
+
+    if (fwrite(slices->directory.data(), 1, slices->directory.size(), file) < slices->directory.size())
+      return false;
+
+    directory_offset = offset;
+    offset += slices->directory.size();
+  }
+
+  // sort by basename bytes, keeping the parts of an archive in order
+  std::stable_sort(toc.begin(), toc.end(), [](const TocEntry& a, const TocEntry& b) { return a.basename < b.basename; });
+
+  // the directory of the files indexed in blocks with --blocks by table of contents entry
+  std::string blocked;
+  uint64_t blocks_offset = 0;
+
+  for (size_t i = 0; i < toc.size(); ++i)
+  {
+    if (toc[i].num_blocks > 0)
+    {
+      uint8_t bytes[24];
+      store32(bytes, static_cast<uint32_t>(i));
+      store32(bytes + 4, toc[i].num_blocks);
+      store64(bytes + 8, toc[i].block_size);
+      store64(bytes + 16, toc[i].blocks);
+      blocked.append(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+    }
+  }
+
+  if (!blocked.empty())
+  {
+    if (fwrite(blocked.data(), 1, blocked.size(), file) < blocked.size())
+      return false;
+
+    blocks_offset = offset;
+    offset += blocked.size();
+  }
+
+  // the offsets of the restart entries followed by the entries with the size of the prefix shared with the previous basename and the rest of the basename
+  std::string restarts;
+  std::string entries;
+  size_t entry_size = slices != NULL ? 16 : 14;
+  uint8_t bytes[16];
+
+  for (size_t i = 0; i < toc.size(); ++i)
+  {
+    const std::string& basename = toc[i].basename;
+    size_t prefix = 0;
+
+    if (i % V4_RESTART == 0)
+    {
+      store32(bytes, static_cast<uint32_t>(entries.size()));
+      restarts.append(reinterpret_cast<const char*>(bytes), 4);
+    }
+    else
+    {
+      const std::string& previous = toc[i - 1].basename;
+      size_t max = std::min(previous.size(), basename.size());
+      while (prefix < max && previous[prefix] == basename[prefix])
+        ++prefix;
+    }
+
+    size_t suffix = basename.size() - prefix;
+
+    bytes[0] = toc[i].accuracy;
+    bytes[1] = toc[i].flags;
+    bytes[2] = static_cast<uint8_t>(prefix);
+    bytes[3] = static_cast<uint8_t>(prefix >> 8);
+    bytes[4] = static_cast<uint8_t>(suffix);
+    bytes[5] = static_cast<uint8_t>(suffix >> 8);
+    store64(bytes + 6, toc[i].offset);
+    bytes[14] = static_cast<uint8_t>(toc[i].lane);
+    bytes[15] = static_cast<uint8_t>(toc[i].lane >> 8);
+    entries.append(reinterpret_cast<const char*>(bytes), entry_size).append(basename, prefix, suffix);
+  }
+
+  uint8_t header[V4_HEADER_SIZE];
+  memset(header, 0, sizeof(header));
+  memcpy(header, ugrep_index_file_magic_v4, sizeof(ugrep_index_file_magic_v4));
+  store32(header + 8, static_cast<uint32_t>(toc.size()));
+  store32(header + 12, V4_RESTART);
+  store64(header + 16, offset);
+  store64(header + 24, restarts.size() + entries.size());
+  store32(header + 32, static_cast<uint32_t>(restarts.size() / 4));
+
+  if (slices != NULL)
+  {
+    store32(header + 36, static_cast<uint32_t>(slices->width));
+    store64(header + 40, directory_offset);
+    store32(header + 48, slices->num_groups);
+  }
+
+  if (!blocked.empty())
+  {
+    store32(header + 52, static_cast<uint32_t>(blocked.size() / 24));
+    store64(header + 56, blocks_offset);
+  }
+
+  return fwrite(restarts.data(), 1, restarts.size(), file) == restarts.size() &&
+         fwrite(entries.data(), 1, entries.size(), file) == entries.size() &&
+         fseeko(file, static_cast<off_t>(base), SEEK_SET) == 0 &&
+         fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+         fseeko(file, 0, SEEK_END) == 0;
+}
+
+// a section of the tree index database with the index of a directory in format 4, its offsets are relative to the start of the section
+struct TreeEntry {
+
+  TreeEntry(const std::string& path, uint64_t time, uint64_t offset, uint64_t size)
+    :
+      path(path),
+      time(time),
+      offset(offset),
+      size(size)
+  { }
+
+  std::string path;   // the directory path relative to the root of the tree
+  uint64_t    time;   // the time the section was written, like the modification time of an index file
+  uint64_t    offset; // offset of the section in the tree index database, 64-byte aligned
+  uint64_t    size;   // size of the section
+
+};
+
+// a tree index database written with --database at the root of the tree, with a section per directory and a manifest of the sections sorted by path
+struct Tree {
+
+  Tree()
+    :
+      file(NULL),
+      map(NULL),
+      map_size(0),
+      ok(true)
+  { }
+
+  ~Tree()
+  {
+    if (file != NULL)
+    {
+      fclose(file);
+      remove(temp_filename.c_str());
+    }
+
+    if (map != NULL)
+      unmap_file(map, map_size);
+  }
+
+  // read the tree index database into memory, then open a temporary tree index database to write unless checking, returns false when the temporary file cannot be created
+  bool open(const std::string& pathname, bool write)
+  {
+    filename.assign(pathname);
+    temp_filename.assign(pathname).append(".tmp");
+
+    FILE *tree_file = NULL;
+
+    if (fopenw_s(&tree_file, filename.c_str(), "rb") == 0)
+    {
+      // map the tree index database to load the sections of all directories at once, or read it when it cannot be mapped
+      size_t size = static_cast<size_t>(file_size(fileno(tree_file)));
+      map = map_file(fileno(tree_file), size);
+      if (map != NULL)
+      {
+        map_size = size;
+      }
+      else
+      {
+        buffer.reset(new uint8_t[size + 1]);
+        size = fread(buffer.get(), 1, size, tree_file);
+      }
+
+      fclose(tree_file);
+
+      read_manifest(size);
+    }
+
+    if (write)
+    {
+      static const uint8_t zeros[V4_HEADER_SIZE] = { 0 };
+
+      if (fopenw_s(&file, temp_filename.c_str(), "wb") != 0)
+      {
+        file = NULL;
+        return false;
+      }
+
+      // the header is written when the tree index database is complete
+      ok = fwrite(zeros, 1, V4_HEADER_SIZE, file) == V4_HEADER_SIZE;
+    }
+
+    return true;
+  }
+
+  // the tree index database read into memory
+  const uint8_t *data() const
+  {
+    return map != NULL ? map : buffer.get();
+  }
+
+  // find the section of a directory in the tree index database read, returns NULL when not found
+  const TreeEntry *find(const std::string& path) const
+  {
+    auto found = std::lower_bound(sections.begin(), sections.end(), path, [](const TreeEntry& entry, const std::string& path) { return entry.path < path; });
+    return found != sections.end() && found->path == path ? &*found : NULL;
+  }
+
+  // begin writing a section at the next 64-byte aligned offset base
+  bool begin(uint64_t& base)
+  {
+    static const uint8_t zeros[V4_ALIGN] = { 0 };
+
+    off_t pos = ftello(file);
+    if (pos < 0)
+      return false;
+
+    size_t padding = static_cast<size_t>((V4_ALIGN - pos % V4_ALIGN) % V4_ALIGN);
+    base = static_cast<uint64_t>(pos) + padding;
+
+    return fwrite(zeros, 1, padding, file) == padding;
+  }
+
+  // end writing the section of a directory at base, time is the time of a section copied or 0 to use the time the section is written
+  bool end(const std::string& path, uint64_t base, uint64_t time)
+  {
+    off_t pos = ftello(file);
+    if (pos < 0)
+      return false;
+
+    if (time == 0)
+    {
+      if (fflush(file) != 0)
+        return false;
+      time = modified_time(fileno(file));
+    }
+
+    manifest.emplace_back(path, time, base, static_cast<uint64_t>(pos) - base);
+
+    return true;
+  }
+
+  // write the manifest sorted by path and the header, then replace the tree index database with the temporary tree index database
+  bool close()
+  {
+    std::sort(manifest.begin(), manifest.end(), [](const TreeEntry& a, const TreeEntry& b) { return a.path < b.path; });
+
+    // the offsets of the entries followed by the entries with the time, offset and size of a section and the path of its directory
+    std::string offsets;
+    std::string entries;
+    uint8_t bytes[28];
+
+    for (const TreeEntry& entry : manifest)
+    {
+      store32(bytes, static_cast<uint32_t>(entries.size()));
+      offsets.append(reinterpret_cast<const char*>(bytes), 4);
+      store64(bytes, entry.time);
+      store64(bytes + 8, entry.offset);
+      store64(bytes + 16, entry.size);
+      store32(bytes + 24, static_cast<uint32_t>(entry.path.size()));
+      entries.append(reinterpret_cast<const char*>(bytes), 28).append(entry.path);
+    }
+
+    off_t pos = ftello(file);
+
+    uint8_t header[V4_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, ugrep_tree_file_magic, sizeof(ugrep_tree_file_magic));
+    store32(header + 8, static_cast<uint32_t>(manifest.size()));
+    store64(header + 16, static_cast<uint64_t>(pos));
+    store64(header + 24, offsets.size() + entries.size());
+
+    ok = ok && pos >= 0 &&
+         fwrite(offsets.data(), 1, offsets.size(), file) == offsets.size() &&
+         fwrite(entries.data(), 1, entries.size(), file) == entries.size() &&
+         fseeko(file, 0, SEEK_SET) == 0 &&
+         fwrite(header, 1, sizeof(header), file) == sizeof(header);
+    ok = fclose(file) == 0 && ok;
+    file = NULL;
+
+    if (!ok || renamew(temp_filename.c_str(), filename.c_str()) != 0)
+    {
+      remove(temp_filename.c_str());
+      return false;
+    }
+
+    return true;
+  }
+
+  // read the manifest of the tree index database read into memory, sections that are cut short or corrupt are ignored
+  void read_manifest(size_t size)
+  {
+    const uint8_t *tree = data();
+
+    if (size < V4_HEADER_SIZE || memcmp(tree, ugrep_tree_file_magic, sizeof(ugrep_tree_file_magic)) != 0)
+      return;
+
+    uint32_t num_sections = load32(tree + 8);
+    uint64_t pos = load64(tree + 16);
+    uint64_t end = pos + load64(tree + 24);
+
+    if (pos > size || end > size || end < pos)
+      return;
+
+    pos += 4 * static_cast<uint64_t>(num_sections);
+
+    for (uint32_t i = 0; i < num_sections && pos + 28 <= end; ++i)
+    {
+      uint64_t time = load64(tree + pos);
+      uint64_t offset = load64(tree + pos + 8);
+      uint64_t section_size = load64(tree + pos + 16);
+      uint32_t path_size = load32(tree + pos + 24);
+
+      pos += 28;
+
+      if (pos + path_size > end)
+        break;
+
+      if (offset <= size && section_size <= size - offset)
+        sections.emplace_back(std::string(reinterpret_cast<const char*>(tree + pos), path_size), time, offset, section_size);
+
+      pos += path_size;
+    }
+
+    std::sort(sections.begin(), sections.end(), [](const TreeEntry& a, const TreeEntry& b) { return a.path < b.path; });
+  }
+
+  std::string                 filename;      // the tree index database pathname
+  std::string                 temp_filename; // the temporary tree index database written to replace the tree index database
+  FILE                       *file;          // the temporary tree index database to write
+  const uint8_t              *map;           // the tree index database mapped into memory
+  size_t                      map_size;      // the size of the mapping
+  std::unique_ptr<uint8_t[]>  buffer;        // the tree index database read into memory when it cannot be mapped
+  std::vector<TreeEntry>      sections;      // the sections of the tree index database read, sorted by path
+  std::vector<TreeEntry>      manifest;      // the sections written
+  bool                        ok;            // false when writing failed
+
+};
+
+// a file in the trigram index written with --trigrams, identified by its path relative to the root and by its file ID in the posting lists
+struct GramsFile {
+
+  GramsFile(const std::string& path, uint64_t time, uint32_t id)
+    :
+      path(path),
+      time(time),
+      id(id),
+      seen(false),
+      replaced(false)
+  { }
+
+  std::string path;     // the file path relative to the root of the directory tree
+  uint64_t    time;     // the modification time of the file when indexed
+  uint32_t    id;       // the file ID
+  bool        seen;     // true when the file is present in the directory tree
+  bool        replaced; // true when the file was modified and is indexed again with a new file ID
+
+};
+
+// the trigram index ._UG#_Grams written with --trigrams at the root of the directory tree instead of the index files of the directories,
+// an inverted index of posting lists of file IDs per trigram, so that a search tool finds the candidate files of a pattern by intersecting
+// the posting lists of its trigrams in time proportional to the number of matching files instead of probing a hashes table per file:
+//
+//   header   64 bytes with "UG#G\0", u32 number of segments @8, u32 number of shards @12, u64 manifest offset @16, u64 manifest size @24,
+//            u32 next file ID @32, u32 number of files @36 and u32 flags @40, bit 0 is set when trigrams are case-folded with --ignore-case
+//   segment  64-byte aligned, per shard a dictionary of {u32 trigram, u32 number of file IDs, u64 posting list offset} sorted by trigram
+//            followed by the posting lists of increasing file IDs stored as varint deltas, then the shard directory with {u64 dictionary
+//            offset, u64 number of trigrams} per shard, where offsets are relative to the start of the segment
+//   manifest {u64 offset, u64 size} per segment, the u32 offsets of the file entries, then the file entries {u32 file ID, u32 path size,
+//            u64 modification time, path} sorted by file ID
+//
+// the shard of a trigram is the high byte of the trigram multiplied by 0x9e3779b1, a varint stores 7 bits per byte with the high bit set
+// when more bytes follow, the index is updated by appending a segment with the new and modified files and a manifest of the files, then
+// the header is rewritten to point to the manifest, so the index is never partially updated, the file IDs in posting lists that are not
+// in the manifest are the file IDs of deleted and modified files, the index is rewritten with one segment of the posting lists of the
+// files renumbered when too many segments or dead file IDs or too much garbage accumulate
+struct Grams {
+
+  Grams()
+    :
+      file(NULL),
+      temp(false),
+      map(NULL),
+      map_size(0),
+      valid(false),
+      offset(0),
+      size(0),
+      manifest_size(0),
+      next_id(0),
+      ok(true)
+  { }
+
+  ~Grams()
+  {
+    if (file != NULL)
+    {
+      fclose(file);
+      if (temp)
+        remove(temp_filename.c_str());
+    }
+
+    release();
+  }
+
+  // read the trigram index into memory unless -f is specified, then open the trigram index to write unless checking, returns false when the trigram index cannot be written
+  bool open(const std::string& root_path, const std::string& pathname, bool write)
+  {
+    root.assign(root_path);
+    filename.assign(pathname);
+    temp_filename.assign(pathname).append(".tmp");
+
+    if (!flag_force)
+      load();
+
+    return !write || begin_write(valid);
+  }
+
+  // the trigram index read into memory
+  const uint8_t *data() const
+  {
+    return map != NULL ? map : buffer.get();
+  }
+
+  // find a file in the trigram index read, returns NULL when not found
+  GramsFile *find(const std::string& path)
+  {
+    auto found = std::lower_bound(files.begin(), files.end(), path, [](const GramsFile& entry, const std::string& path) { return entry.path < path; });
+    return found != files.end() && found->path == path ? &*found : NULL;
+  }
+
+  // add a new or modified file with a new file ID and the trigrams collected in the set, then write a segment when many pairs are collected
+  void add(const std::string& path, uint64_t time)
+  {
+    uint32_t id = next_id++;
+
+    added.emplace_back(path, time, id);
+
+    for (uint32_t gram : set.grams)
+      keys.push_back(key(gram, id));
+    set.clear();
+
+    if (keys.size() >= GRAMS_FLUSH)
+      write_segment();
+  }
+
+  // the number of files in the trigram index read that are not present in the directory tree
+  size_t deleted() const
+  {
+    size_t count = 0;
+    for (const GramsFile& entry : files)
+      count += !entry.seen;
+    return count;
+  }
+
+  // write the segment of the pairs collected, the manifest of the files and the header, then compact the trigram index when too many
+  // segments or dead file IDs or too much garbage accumulated
+  bool close()
+  {
+    std::vector<GramsFile> live;
+    for (const GramsFile& entry : files)
+      if (entry.seen && !entry.replaced)
+        live.push_back(entry);
+
+    // keep the trigram index when no files were removed or added
+    if (valid && added.empty() && live.size() == files.size())
+    {
+      ok = fclose(file) == 0 && ok;
+      file = NULL;
+      return ok;
+    }
+
+    live.insert(live.end(), added.begin(), added.end());
+    std::sort(live.begin(), live.end(), [](const GramsFile& a, const GramsFile& b) { return a.id < b.id; });
+
+    if (!keys.empty())
+      write_segment();
+
+    write_manifest(live);
+
+    ok = fclose(file) == 0 && ok;
+    file = NULL;
+
+    if (!ok || (temp && renamew(temp_filename.c_str(), filename.c_str()) != 0))
+    {
+      if (temp)
+        remove(temp_filename.c_str());
+      return false;
+    }
+
+    size = offset;
+
+    uint64_t used = V4_HEADER_SIZE + manifest_size;
+    for (const auto& segment : segments)
+      used += segment.second;
+
+    if (segments.size() > GRAMS_MAX_SEGMENTS || next_id - live.size() > live.size() || size > 2 * used)
+      return compact();
+
+    return true;
+  }
+
+  // rewrite the trigram index with the files renumbered in the order of their file IDs and the posting lists of the segments merged
+  // shard by shard into one segment without the file IDs of deleted and modified files, then replace the trigram index
+  bool compact()
+  {
+    release();
+    load();
+
+    if (!valid || !begin_write(false))
+      return false;
+
+    const uint8_t *grams = data();
+
+    // map the file IDs to the new file IDs, the file IDs of deleted and modified files are mapped to none
+    const uint32_t none = 0xffffffff;
+    std::vector<uint32_t> ids(next_id, none);
+    std::sort(files.begin(), files.end(), [](const GramsFile& a, const GramsFile& b) { return a.id < b.id; });
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+      if (files[i].id < next_id)
+        ids[files[i].id] = static_cast<uint32_t>(i);
+      files[i].id = static_cast<uint32_t>(i);
+    }
+
+    std::vector<uint64_t> pairs;
+    uint8_t directory[16 * GRAMS_SHARDS];
+
+    ok = ok && align();
+    uint64_t base = offset;
+
+    for (uint32_t shard = 0; shard < GRAMS_SHARDS; ++shard)
+    {
+      pairs.clear();
+
+      for (const auto& segment : segments)
+      {
+        const uint8_t *start = grams + segment.first;
+        const uint8_t *end = start + segment.second;
+        const uint8_t *entry = end - sizeof(directory) + 16 * shard;
+        uint64_t dictionary = load64(entry);
+        uint64_t num_grams = load64(entry + 8);
+
+        if (dictionary > segment.second || num_grams > (segment.second - dictionary) / 16)
+          continue;
+
+        for (const uint8_t *next = start + dictionary; num_grams > 0; --num_grams, next += 16)
+        {
+          uint32_t gram = load32(next);
+          uint32_t count = load32(next + 4);
+          uint64_t postings = load64(next + 8);
+          uint32_t id = 0;
+
+          if (postings > segment.second)
+            continue;
+
+          // decode the varint deltas of the file IDs
+          for (const uint8_t *p = start + postings; count > 0 && p < end; --count)
+          {
+            uint32_t delta = 0;
+            for (unsigned shift = 0; p < end; shift += 7)
+            {
+              delta |= static_cast<uint32_t>(*p & 0x7f) << shift;
+              if ((*p++ & 0x80) == 0)
+                break;
+            }
+
+            id += delta;
+            if (id < next_id && ids[id] != none)
+              pairs.push_back(key(gram, ids[id]));
+          }
+        }
+      }
+
+      std::sort(pairs.begin(), pairs.end());
+      write_shard(base, pairs.data(), pairs.size(), directory + 16 * shard);
+    }
+
+    write(directory, sizeof(directory));
+
+    segments.clear();
+    segments.emplace_back(base, offset - base);
+    next_id = static_cast<uint32_t>(files.size());
+
+    write_manifest(files);
+
+    ok = fclose(file) == 0 && ok;
+    file = NULL;
+
+    if (!ok || renamew(temp_filename.c_str(), filename.c_str()) != 0)
+    {
+      remove(temp_filename.c_str());
+      return false;
+    }
+
+    size = offset;
+
+    return true;
+  }
+
+  // the shard of a trigram
+  static uint32_t shard(uint32_t gram)
+  {
+    return (gram * 0x9e3779b1U) >> 24;
+  }
+
+  // the sort key of a trigram and file ID pair, ordered by shard, trigram and file ID
+  static uint64_t key(uint32_t gram, uint32_t id)
+  {
+    return (static_cast<uint64_t>(shard(gram)) << 56) | (static_cast<uint64_t>(gram) << 32) | id;
+  }
+
+  // the flags of the trigram index
+  static uint32_t flags()
+  {
+    return flag_ignore_case ? 1 : 0;
+  }
+
+  // read the trigram index into memory, mapped or read when it cannot be mapped
+  void load()
+  {
+    FILE *grams_file = NULL;
+
+    if (fopenw_s(&grams_file, filename.c_str(), "rb") != 0)
+      return;
+
+    size = static_cast<size_t>(file_size(fileno(grams_file)));
+    map = map_file(fileno(grams_file), size);
+    if (map != NULL)
+    {
+      map_size = size;
+    }
+    else
+    {
+      buffer.reset(new uint8_t[size + 1]);
+      size = fread(buffer.get(), 1, size, grams_file);
+    }
+
+    fclose(grams_file);
+
+    valid = read_manifest();
+  }
+
+  // release the trigram index read into memory
+  void release()
+  {
+    if (map != NULL)
+      unmap_file(map, map_size);
+    map = NULL;
+    map_size = 0;
+    buffer.reset();
+    valid = false;
+    segments.clear();
+    files.clear();
+  }
+
+  // read the manifest of the trigram index read into memory, returns false when the trigram index is corrupt or written with other flags
+  bool read_manifest()
+  {
+    const uint8_t *grams = data();
+
+    if (size < V4_HEADER_SIZE ||
+        memcmp(grams, ugrep_grams_file_magic, sizeof(ugrep_grams_file_magic)) != 0 ||
+        load32(grams + 12) != GRAMS_SHARDS ||
+        load32(grams + 40) != flags())
+      return false;
+
+    uint32_t num_segments = load32(grams + 8);
+    uint64_t pos = load64(grams + 16);
+    uint64_t end = pos + load64(grams + 24);
+    uint32_t num_files = load32(grams + 36);
+
+    if (pos > size || end > size || end < pos || 16 * static_cast<uint64_t>(num_segments) + 4 * static_cast<uint64_t>(num_files) > end - pos)
+      return false;
+
+    next_id = load32(grams + 32);
+    manifest_size = end - pos;
+
+    for (uint32_t i = 0; i < num_segments; ++i, pos += 16)
+    {
+      uint64_t base = load64(grams + pos);
+      uint64_t segment_size = load64(grams + pos + 8);
+
+      if (base > size || segment_size > size - base || segment_size < 16 * GRAMS_SHARDS)
+        return false;
+
+      segments.emplace_back(base, segment_size);
+    }
+
+    pos += 4 * static_cast<uint64_t>(num_files);
+
+    for (uint32_t i = 0; i < num_files; ++i)
+    {
+      if (pos + 16 > end)
+        return false;
+
+      uint32_t id = load32(grams + pos);
+      uint32_t path_size = load32(grams + pos + 4);
+      uint64_t time = load64(grams + pos + 8);
+
+      pos += 16;
+
+      if (path_size > end - pos)
+        return false;
+
+      files.emplace_back(std::string(reinterpret_cast<const char*>(grams + pos), path_size), time, id);
+
+      pos += path_size;
+    }
+
+    std::sort(files.begin(), files.end(), [](const GramsFile& a, const GramsFile& b) { return a.path < b.path; });
+
+    return true;
+  }
+
+  // open the trigram index to append segments, or a temporary trigram index that replaces the trigram index when complete
+  bool begin_write(bool append)
+  {
+    static const uint8_t zeros[V4_HEADER_SIZE] = { 0 };
+
+    temp = !append;
+    if (fopenw_s(&file, temp ? temp_filename.c_str() : filename.c_str(), temp ? "wb" : "r+b") != 0)
+    {
+      file = NULL;
+      return false;
+    }
+
+    if (!temp)
+    {
+      // append after the end of the trigram index
+      off_t pos;
+      ok = fseeko(file, 0, SEEK_END) == 0 && (pos = ftello(file)) >= 0;
+      offset = ok ? static_cast<uint64_t>(pos) : 0;
+      return ok;
+    }
+
+    // the header is written when the trigram index is complete
+    offset = 0;
+    return write(zeros, V4_HEADER_SIZE);
+  }
+
+  // write data to the trigram index
+  bool write(const void *data, size_t data_size)
+  {
+    ok = ok && fwrite(data, 1, data_size, file) == data_size;
+    offset += data_size;
+    return ok;
+  }
+
+  // pad the trigram index to the next 64-byte aligned offset
+  bool align()
+  {
+    static const uint8_t zeros[V4_ALIGN] = { 0 };
+    return write(zeros, static_cast<size_t>((V4_ALIGN - offset % V4_ALIGN) % V4_ALIGN));
+  }
+
+  // write the pairs collected as a segment, sorted by shard, trigram and file ID
+  bool write_segment()
+  {
+    uint8_t directory[16 * GRAMS_SHARDS];
+
+    std::sort(keys.begin(), keys.end());
+
+    ok = ok && align();
+    uint64_t base = offset;
+
+    size_t i = 0;
+    for (uint32_t shard = 0; shard < GRAMS_SHARDS; ++shard)
+    {
+      size_t j = i;
+      while (j < keys.size() && (keys[j] >> 56) == shard)
+        ++j;
+      write_shard(base, keys.data() + i, j - i, directory + 16 * shard);
+      i = j;
+    }
+
+    write(directory, sizeof(directory));
+
+    segments.emplace_back(base, offset - base);
+    keys.clear();
+
+    return ok;
+  }
+
+  // write the dictionary and the posting lists of the sorted pairs of a shard of the segment at base and store the shard directory entry
+  bool write_shard(uint64_t base, const uint64_t *pairs, size_t n, uint8_t *entry)
+  {
+    size_t num_grams = 0;
+    for (size_t i = 0; i < n; ++i)
+      num_grams += i == 0 || (pairs[i] >> 32) != (pairs[i - 1] >> 32);
+
+    uint64_t dictionary = offset - base;
+    uint64_t postings = dictionary + 16 * num_grams;
+    std::string entries;
+    std::string lists;
+    uint8_t bytes[16];
+
+    for (size_t i = 0; i < n; )
+    {
+      size_t j = i;
+      uint32_t last = 0;
+
+      store32(bytes, static_cast<uint32_t>(pairs[i] >> 32) & 0xffffff);
+      store64(bytes + 8, postings + lists.size());
+
+      // the varint deltas of the increasing file IDs of the trigram
+      for (; j < n && (pairs[j] >> 32) == (pairs[i] >> 32); ++j)
+      {
+        uint32_t id = static_cast<uint32_t>(pairs[j]);
+        uint32_t delta = id - last;
+        for (; delta >= 0x80; delta >>= 7)
+          lists.push_back(static_cast<char>(delta | 0x80));
+        lists.push_back(static_cast<char>(delta));
+        last = id;
+      }
+
+      store32(bytes + 4, static_cast<uint32_t>(j - i));
+      entries.append(reinterpret_cast<const char*>(bytes), 16);
+      i = j;
+    }
+
+    store64(entry, dictionary);
+    store64(entry + 8, num_grams);
+
+    return write(entries.data(), entries.size()) && write(lists.data(), lists.size());
+  }
+
+  // write the manifest of the segments and the files sorted by file ID, then write the header
+  bool write_manifest(const std::vector<GramsFile>& manifest)
+  {
+    // the segments, the offsets of the file entries and the file entries with the file ID, the path size, the time and the path
+    std::string table;
+    std::string offsets;
+    std::string entries;
+    uint8_t bytes[16];
+
+    for (const auto& segment : segments)
+    {
+      store64(bytes, segment.first);
+      store64(bytes + 8, segment.second);
+      table.append(reinterpret_cast<const char*>(bytes), 16);
+    }
+
+    for (const GramsFile& entry : manifest)
+    {
+      store32(bytes, static_cast<uint32_t>(entries.size()));
+      offsets.append(reinterpret_cast<const char*>(bytes), 4);
+      store32(bytes, entry.id);
+      store32(bytes + 4, static_cast<uint32_t>(entry.path.size()));
+      store64(bytes + 8, entry.time);
+      entries.append(reinterpret_cast<const char*>(bytes), 16).append(entry.path);
+    }
+
+    uint64_t pos = offset;
+
+    write(table.data(), table.size());
+    write(offsets.data(), offsets.size());
+    write(entries.data(), entries.size());
+
+    manifest_size = offset - pos;
+
+    uint8_t header[V4_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, ugrep_grams_file_magic, sizeof(ugrep_grams_file_magic));
+    store32(header + 8, static_cast<uint32_t>(segments.size()));
+    store32(header + 12, GRAMS_SHARDS);
+    store64(header + 16, pos);
+    store64(header + 24, manifest_size);
+    store32(header + 32, next_id);
+    store32(header + 36, static_cast<uint32_t>(manifest.size()));
+    store32(header + 40, flags());
+
+    ok = ok &&
+         fseeko(file, 0, SEEK_SET) == 0 &&
+         fwrite(header, 1, sizeof(header), file) == sizeof(header);
+
+    return ok;
+  }
+
+  std::string                               root;          // the root of the directory tree
+  std::string                               filename;      // the trigram index pathname
+  std::string                               temp_filename; // the temporary trigram index written to replace the trigram index
+  FILE                                     *file;          // the trigram index to append to or the temporary trigram index to write
+  bool                                      temp;          // true when writing the temporary trigram index
+  const uint8_t                            *map;           // the trigram index mapped into memory
+  size_t                                    map_size;      // the size of the mapping
+  std::unique_ptr<uint8_t[]>                buffer;        // the trigram index read into memory when it cannot be mapped
+  bool                                      valid;         // true when the trigram index read is valid and is updated
+  uint64_t                                  offset;        // the end of the trigram index written
+  uint64_t                                  size;          // the size of the trigram index read, then written
+  uint64_t                                  manifest_size; // the size of the manifest read, then written
+  uint32_t                                  next_id;       // the next file ID
+  std::vector<std::pair<uint64_t,uint64_t>> segments;      // the offsets and sizes of the segments
+  std::vector<GramsFile>                    files;         // the files of the trigram index read, sorted by path
+  std::vector<GramsFile>                    added;         // the new and modified files added with new file IDs
+  std::vector<uint64_t>                     keys;          // the trigram and file ID pairs collected for the next segment
+  TrigramSet                                set;           // the trigrams of the parts of the file to add
+  bool                                      ok;            // false when writing failed
+
+};
+
+// read the records of a file stored in its extended attribute with --xattr, returns false when not present
+bool read_xattr(const char *pathname, std::string& value)
+{
+  // read the value with one call when it fits the buffer, which fits the value of most files
+  value.resize(std::max(value.capacity(), static_cast<size_t>(4096)));
+  int64_t size = get_xattr(pathname, ugrep_index_xattr, &value[0], value.size());
+
+  if (size < 0 && errno == ERANGE)
+  {
+    size = get_xattr(pathname, ugrep_index_xattr, NULL, 0);
+    if (size < 4)
+      return false;
+
+    value.resize(static_cast<size_t>(size));
+    size = get_xattr(pathname, ugrep_index_xattr, &value[0], value.size());
+  }
+
+  if (size < 4)
+    return false;
+
+  value.resize(static_cast<size_t>(size));
+  return true;
+}
+
+// store the records of a file in its extended attribute with --xattr, the hashes tables are folded in half until the records fit the file system's limit on the size of an extended attribute
+bool write_xattr(const char *pathname, std::string& value)
+{
+  while (set_xattr(pathname, ugrep_index_xattr, value.data(), value.size()) != 0)
+  {
+    if (errno != E2BIG && errno != ENOSPC && errno != ERANGE)
+      return false;
+
+    std::string folded;
+    bool fold = false;
+    size_t pos = 0;
+
+    while (pos + 4 <= value.size())
+    {
+      uint8_t *header = reinterpret_cast<uint8_t*>(&value[pos]);
+      size_t basename_size = header[2] | (header[3] << 8);
+      size_t hashes_size = table_size(header[1]);
+      uint8_t *hashes = header + 4 + basename_size;
+
+      if (pos + 4 + basename_size + hashes_size > value.size())
+        return false;
+
+      pos += 4 + basename_size + hashes_size;
+
+      // fold tables larger than 64 bytes to half their size, decrementing the log2 of the table size in the header
+      if (hashes_size > 64)
+      {
+        kernel->fold(hashes, hashes_size, hashes_size / 2);
+        hashes_size /= 2;
+        --header[1];
+        fold = true;
+      }
+
+      folded.append(reinterpret_cast<const char*>(header), 4 + basename_size).append(reinterpret_cast<const char*>(hashes), hashes_size);
+    }
+
+    if (!fold)
+      return false;
+
+    value.swap(folded);
+  }
+
+  return true;
+}
+
+// a directory with its index file and the jobs to index its files, the index file is closed when all jobs are written
+struct Batch {
+
+  Batch(const std::string& pathname, FILE *index_file, const std::string& temp_filename, const std::string& index_filename)
+    :
+      pathname(pathname),
+      index_file(index_file),
+      temp_filename(temp_filename),
+      index_filename(index_filename),
+      v4(false),
+      offset(0),
+      tree(NULL),
+      started(false),
+      base(0),
+      copy(NULL),
+      xattr(false),
+      time(0),
+      grams(NULL),
+      complete(false)
+  { }
+
+  std::string                      pathname;       // directory pathname
+  FILE                            *index_file;     // the index file to write
+  std::string                      temp_filename;  // the temporary index file written to replace the index file, empty when appending to the index file
+  std::string                      index_filename; // the index file pathname
+  bool                             v4;             // true when writing a format 4 index file
+  uint64_t                         offset;         // the end of the hashes tables written to a format 4 index file
+  std::vector<TocEntry>            toc;            // the table of contents of a format 4 index file
+  std::unique_ptr<Slices>          slices;         // the groups of bit-sliced tables of a format 4 index file with --slices, or NULL
+  Tree                            *tree;           // the tree index database to write the section of the directory to with --database, or NULL
+  std::string                      path;           // the directory path relative to the root of the tree
+  bool                             started;        // true when the section of the directory is started in the tree index database
+  uint64_t                         base;           // the offset of the section of the directory in the tree index database
+  std::vector<Record>              preserved;      // the records of the section read from the tree index database that are preserved
+  const TreeEntry                 *copy;           // the section of an up-to-date directory to copy to the tree index database, or NULL
+  bool                             xattr;          // true when storing the records of the files in their extended attributes with --xattr
+  uint64_t                         time;           // the index time to store in the extended attribute of the directory with --xattr
+  Grams                           *grams;          // the trigram index to add the files to with --trigrams, or NULL
+  std::deque<std::unique_ptr<Job>> jobs;           // jobs in the order of the file entries
+  bool                             complete;       // true when all jobs of the directory are submitted
+
+};
+
+// worker threads to index files, each with its own stream and hashes table and with --trigrams a trigram set, without threads jobs are executed by the main thread when submitted
+// reader threads read small files ahead into pooled blocks in the order of the jobs, so the workers hash the files while the readers keep the disk busy
+struct Workers {
+
+  Workers(size_t num_threads, size_t num_readers)
+    :
+      quit(false),
+      hashes(num_threads == 0 ? new uint8_t[static_cast<size_t>(1) << flag_hash_bits] : NULL),
+      trigrams(num_threads == 0 && flag_trigrams ? new TrigramSet : NULL)
+  {
+    if (num_threads > 0)
+    {
+      // the pool of blocks bounds the number of files read ahead
+      for (size_t i = 0; i < 4 * (num_threads + num_readers); ++i)
+        pool.emplace_back(new Block);
+      for (size_t i = 0; i < num_readers; ++i)
+        readers.emplace_back(&Workers::read, this);
+      for (size_t i = 0; i < num_threads; ++i)
+        threads.emplace_back(&Workers::execute, this);
+    }
+  }
+
+  ~Workers()
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      quit = true;
+    }
+    work.notify_all();
+    reading.notify_all();
+    for (auto& thread : readers)
+      thread.join();
+    for (auto& thread : threads)
+      thread.join();
+  }
+
+  // submit a job to a worker or index the file now when we have no worker threads
+  void submit(Job *job)
+  {
+    if (threads.empty())
+    {
+      index_job(stream, hashes.get(), trigrams.get(), *job);
+      return;
+    }
+
+    // read small files ahead with the readers, except compressed files and archives that are read by the decompression thread with -z
+    bool read_ahead = !readers.empty() && !flag_decompress && job->entry.size > 0 && job->entry.size <= BUF_SIZE;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      queue.push_back(job);
+      if (read_ahead)
+      {
+        job->read = false;
+        reads.push_back(job);
+      }
+    }
+    work.notify_one();
+    if (read_ahead)
+      reading.notify_one();
+  }
+
+  // return true if the job has a part to write or is done, without blocking
+  bool ready(Job& job)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    return job.done || !job.parts.empty();
+  }
+
+  // get the next indexed part of the job, blocks until the part is available, returns false when the job is done
+  bool next(Job& job, Part& part)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (job.parts.empty() && !job.done)
+      indexed.wait(lock);
+    if (job.parts.empty())
+      return false;
+    part = std::move(job.parts.front());
+    job.parts.pop_front();
+    return true;
+  }
+
+  // reader thread loop, takes blocks from the pool then the next jobs, so blocks are never held by jobs after a job waiting for its block
+  void read()
+  {
+    // read batches of small files with io_uring when available, otherwise read one file at a time
+    Uring uring;
+    size_t batch = uring.init(64) ? uring.batch() : 1;
+    std::vector<std::unique_ptr<Block>> blocks;
+    std::vector<Job*> jobs;
+
+    while (true)
+    {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while ((reads.empty() || pool.empty()) && !quit)
+          reading.wait(lock);
+        if (quit)
+          break;
+        while (jobs.size() < batch && !reads.empty() && !pool.empty())
+        {
+          blocks.push_back(std::move(pool.back()));
+          pool.pop_back();
+          jobs.push_back(reads.front());
+          reads.pop_front();
+        }
+      }
+
+      if (batch > 1)
+        read_blocks(uring, jobs, blocks);
+      else
+        read_block(jobs.front()->entry.pathname.c_str(), *blocks.front());
+
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (size_t i = 0; i < jobs.size(); ++i)
+        {
+          jobs[i]->block = std::move(blocks[i]);
+          jobs[i]->read = true;
+        }
+      }
+      loaded.notify_all();
+
+      jobs.clear();
+      blocks.clear();
+    }
+  }
+
+  // read a batch of small files into blocks with io_uring, the worker reads a file instead when the file changed or when the file starts with a byte of a UTF BOM, because reflex::Input converts UTF-16/32 files
+  static void read_blocks(Uring& uring, const std::vector<Job*>& jobs, std::vector<std::unique_ptr<Block>>& blocks)
+  {
+    size_t n = jobs.size();
+    std::vector<const char*> pathnames(n);
+    std::vector<char*> buffers(n);
+    std::vector<int64_t> sizes(n);
+
+    for (size_t i = 0; i < n; ++i)
+    {
+      pathnames[i] = jobs[i]->entry.pathname.c_str();
+      buffers[i] = blocks[i]->data;
+    }
+
+    uring.read(n, pathnames.data(), buffers.data(), BUF_SIZE, sizes.data(), flag_no_cache);
+
+    for (size_t i = 0; i < n; ++i)
+    {
+      Block& block = *blocks[i];
+      block.size = sizes[i] > 0 ? static_cast<size_t>(sizes[i]) : 0;
+      block.whole =
+        block.size > 0 &&
+        block.size < BUF_SIZE &&
+        block.size == jobs[i]->entry.size &&
+        block.data[0] != '\0' &&
+        block.data[0] != '\xef' &&
+        block.data[0] != '\xfe' &&
+        block.data[0] != '\xff';
+    }
+  }
+
+  // read a small file into a block, the worker reads the file instead when the file cannot be opened or when it does not fit the block
+  static void read_block(const char *pathname, Block& block)
+  {
+    FILE *file = NULL;
+
+    block.size = 0;
+    block.whole = false;
+
+    if (fopenw_s(&file, pathname, "rb") != 0)
+      return;
+
+    if (flag_no_cache)
+      no_cache(fileno(file));
+
+    reflex::Input input(file);
+    size_t len;
+
+    while (block.size < BUF_SIZE && (len = input.get(block.data + block.size, BUF_SIZE - block.size)) > 0)
+      block.size += len;
+
+    // the file fits the block when we reached the end, note that UTF-16/32 files are converted and may grow
+    char extra;
+    block.whole = block.size < BUF_SIZE || input.get(&extra, 1) == 0;
+
+    // drop the cached pages with --no-cache, unless the worker reads the file again
+    if (flag_no_cache && block.whole)
+      drop_cache(fileno(file));
+
+    fclose(file);
+  }
+
+  // worker thread loop
+  void execute()
+  {
+    Stream worker_stream;
+    std::unique_ptr<uint8_t[]> worker_hashes(new uint8_t[static_cast<size_t>(1) << flag_hash_bits]);
+    std::unique_ptr<TrigramSet> worker_trigrams(flag_trigrams ? new TrigramSet : NULL);
+
+    while (true)
+    {
+      Job *job;
+
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (queue.empty() && !quit)
+          work.wait(lock);
+        if (quit)
+          break;
+        job = queue.front();
+        queue.pop_front();
+
+        // wait for the reader to read the file ahead
+        while (!job->read)
+          loaded.wait(lock);
+      }
+
+      // take the block from the job, because the job is deleted by the main thread after the job is done
+      std::unique_ptr<Block> block(std::move(job->block));
+      if (block && block->whole)
+        worker_stream.block = block.get();
+
+      index_job(worker_stream, worker_hashes.get(), worker_trigrams.get(), *job);
+
+      // return the block to the pool
+      if (block)
+      {
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          pool.push_back(std::move(block));
+        }
+        reading.notify_one();
+      }
+    }
+  }
+
+  // index the file of the job and add the indexed parts to the job, with --trigrams the parts have the trigrams collected instead of hashes tables
+  void index_job(Stream& stream, uint8_t *hashes, TrigramSet *trigrams, Job& job)
+  {
+    const char *pathname = job.entry.pathname.c_str();
+    size_t hashes_size = 0;
+    Part part;
+
+    // if the file is a a zip archive, then index archived content for each part
+    part.size = job.entry.size;
+
+    if (part.size == 0 || index(stream, pathname, hashes, hashes_size, part.noise, part.compressed, part.archive, part.binary, part.size, part.blocks, trigrams))
+    {
+      do
+      {
+        if (part.archive)
+          part.partname = stream.partname;
+        part.hashes.assign(hashes, hashes + hashes_size);
+        if (trigrams != NULL)
+        {
+          part.trigrams = trigrams->grams;
+          trigrams->clear();
+        }
 
-    for (size_t i = 0; i < half; ++i)
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          job.parts.push_back(part);
+        }
+        indexed.notify_all();
+      } while (part.archive && index(stream, pathname, hashes, hashes_size, part.noise, part.compressed, part.archive, part.binary, part.size, part.blocks, trigrams));
+    }
+    else
     {
-      half_noise += (hashes[i] & hashes[i + half] & 0x01) == 0;
-      half_noise += (hashes[i] & hashes[i + half] & 0x02) == 0;
-      half_noise += (hashes[i] & hashes[i + half] & 0x04) == 0;
-      half_noise += (hashes[i] & hashes[i + half] & 0x08) == 0;
-      half_noise += (hashes[i] & hashes[i + half] & 0x10) == 0;
-      half_noise += (hashes[i] & hashes[i + half] & 0x20) == 0;
-      half_noise += (hashes[i] & hashes[i + half] & 0x40) == 0;
-      half_noise += (hashes[i] & hashes[i + half] & 0x80) == 0;
+      job.failed = true;
     }
 
-    half_noise /= 8 * half;
-
-    // stop at desired accuracy
-    if (100.0 * half_noise >= max_noise)
-      break;
-
-    // compress hashes table
-    for (size_t i = 0; i < half; ++i)
-      hashes[i] &= hashes[i + half];
-
-    hashes_size = half;
-    noise = half_noise;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      job.done = true;
+    }
+    indexed.notify_all();
   }
 
-  return true;
-}
+  std::vector<std::thread>            threads;  // worker threads
+  std::vector<std::thread>            readers;  // reader threads
+  std::deque<Job*>                    queue;    // jobs to execute by the worker threads
+  std::deque<Job*>                    reads;    // jobs with files to read ahead by the reader threads
+  std::vector<std::unique_ptr<Block>> pool;     // blocks to read files ahead
+  std::mutex                          mutex;    // mutex to access the queues, the pool and jobs
+  std::condition_variable             work;     // cv to notify workers of new jobs or to quit
+  std::condition_variable             reading;  // cv to notify readers of new jobs or free blocks or to quit
+  std::condition_variable             loaded;   // cv to notify workers of files read ahead
+  std::condition_variable             indexed;  // cv to notify the main thread of indexed parts
+  bool                                quit;     // true when the workers should quit
+  Stream                              stream;   // stream to index files by the main thread when we have no worker threads
+  std::unique_ptr<uint8_t[]>          hashes;   // hashes table to index files by the main thread when we have no worker threads
+  std::unique_ptr<TrigramSet>         trigrams; // trigram set to index files by the main thread with --trigrams when we have no worker threads
+
+};
 
 // trim white space from either end of the line
 inline void trim(std::string& line)
@@ -1104,14 +4108,14 @@ void import_globs(FILE *file, StrVec& files, StrVec& dirs)
 }
 
 // return true if pathname is a non-excluded directory
-bool include_dir(const char *pathname, const char *basename)
+bool include_dir(const Ignore *ignore, const char *pathname, const char *basename)
 {
   bool ok = true;
 
-  if (!ignore_stack.empty())
+  if (ignore != NULL)
   {
     // exclude directories whose pathname matches any one of the globs unless negated with !
-    for (const auto& glob : ignore_stack.top().dirs)
+    for (const auto& glob : ignore->dirs)
     {
       if (glob.front() == '!')
       {
@@ -1129,14 +4133,14 @@ bool include_dir(const char *pathname, const char *basename)
 }
 
 // return true if pathname is a non-excluded file
-bool include_file(const char *pathname, const char *basename)
+bool include_file(const Ignore *ignore, const char *pathname, const char *basename)
 {
   bool ok = true;
 
-  if (!ignore_stack.empty())
+  if (ignore != NULL)
   {
     // exclude directories whose pathname matches any one of the globs unless negated with !
-    for (const auto& glob : ignore_stack.top().files)
+    for (const auto& glob : ignore->files)
     {
       if (glob.front() == '!')
       {
@@ -1153,13 +4157,54 @@ bool include_file(const char *pathname, const char *basename)
   return ok;
 }
 
-// catalog directory contents
-void cat(const std::string& pathname, std::stack<Entry>& dir_entries, std::vector<Entry>& file_entries, uint64_t& num_dirs, uint64_t& num_links, uint64_t& num_other, int64_t& ign_dirs, int64_t& ign_files, uint64_t& index_time, uint64_t& last_time, bool dir_only = false)
+// return the path of a directory relative to the root of the directory tree, the root itself is .
+std::string relative_path(const std::string& root, const std::string& pathname)
+{
+  if (pathname == root)
+    return ".";
+  if (root == ".")
+    return pathname;
+  return pathname.substr(root.size() + (root.back() != PATHSEPCHR));
+}
+
+// return the pathname of an index file stored with --index-root=DIR, named by the device and inode numbers of the directory and the hash of its absolute pathname, or an empty string when the directory cannot be identified
+std::string index_root_filename(const std::string& pathname, const char *filename)
+{
+  uint64_t dev = 0;
+  uint64_t ino = 0;
+
+  if (!directory_id(pathname, dev, ino))
+    return std::string();
+
+  std::string path(tree_root_real);
+  if (pathname != tree_root)
+  {
+    if (path.empty() || path.back() != PATHSEPCHR)
+      path.push_back(PATHSEPCHR);
+    path.append(relative_path(tree_root, pathname));
+  }
+
+  // FNV-1a hash of the absolute pathname
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (unsigned char c : path)
+    hash = (hash ^ c) * 0x100000001b3ULL;
+
+  char key[64];
+  snprintf(key, sizeof(key), "%" PRIx64 "-%" PRIx64 "-%016" PRIx64, dev, ino, hash);
+
+  std::string index_file(flag_index_root);
+  if (index_file.back() != PATHSEPCHR)
+    index_file.push_back(PATHSEPCHR);
+  return index_file.append(key).append(filename);
+}
+
+// catalog directory contents, this function is thread safe to catalog directories in parallel
+void cat(Dir& dir, bool dir_only = false)
 {
-  // start populating file and link entries, append directory entries (not cleared)
-  file_entries.clear();
-  last_time = 0;
-  index_time = 0;
+  const std::string& pathname = dir.visit.pathname;
+
+  // the ignore globs inherited from the parent directory, replaced by the globs of an ignore file in this directory
+  std::shared_ptr<const Ignore> ignore = dir.ignore;
 
 #ifdef OS_WIN
 
@@ -1184,9 +4229,9 @@ void cat(const std::string& pathname, std::stack<Entry>& dir_entries, std::vecto
 
 #else
 
-  DIR *dir = opendir(pathname.c_str());
+  DIR *dirp = opendir(pathname.c_str());
 
-  if (dir == NULL)
+  if (dirp == NULL)
   {
     error("cannot open directory", pathname.c_str());
     return;
@@ -1196,32 +4241,51 @@ void cat(const std::string& pathname, std::stack<Entry>& dir_entries, std::vecto
 
   if (!dir_only)
   {
-    // check for ignore files, read them and push globs on the ignore_stack
+    // check for ignore files, read them and replace the inherited globs
     if (!flag_ignore_files.empty())
     {
       std::string filepath;
 
-      for (const auto& ignore : flag_ignore_files)
+      for (const auto& ignore_file : flag_ignore_files)
       {
-        filepath.assign(pathname).append(PATHSEPSTR).append(ignore);
+        filepath.assign(pathname).append(PATHSEPSTR).append(ignore_file);
 
         FILE *file = NULL;
 
         if (fopenw_s(&file, filepath.c_str(), "r") == 0)
         {
-          // push globs imported from the ignore file to the back of the vectors
-          ignore_stack.emplace();
-
-          // mark dir_entries stack with an empty pathname as a sentinel to pop the ignore_stack afterwards
-          dir_entries.emplace("");
-          import_globs(file, ignore_stack.top().files, ignore_stack.top().dirs);
+          // globs imported from the ignore file apply to this directory and its subdirectories
+          std::shared_ptr<Ignore> globs = std::make_shared<Ignore>();
+          import_globs(file, globs->files, globs->dirs);
           fclose(file);
+          ignore = std::move(globs);
         }
       }
     }
   }
 
-  ++num_dirs;
+  ++dir.num_dirs;
+
+  // with --xattr the index time of the directory is stored in its extended attribute, the index file is used when not present
+  if (flag_xattr)
+  {
+    uint8_t stamp[XATTR_STAMP_SIZE];
+    // files modified after cataloguing the directory are newer than the index time
+    dir.visit_time = current_time() - 1;
+    if (get_xattr(pathname.c_str(), ugrep_index_xattr, stamp, sizeof(stamp)) == sizeof(stamp) && memcmp(stamp, ugrep_index_xattr_magic, sizeof(ugrep_index_xattr_magic) - 1) == 0)
+    {
+      dir.xattr = true;
+      dir.xattr_time = load64(stamp + 8);
+    }
+  }
+
+  // with --index-root the index file of the directory is stored under DIR instead of the directory
+  if (!flag_index_root.empty())
+  {
+    dir.index_file = index_root_filename(pathname, ugrep_index_filename);
+    if (!dir.index_file.empty())
+      dir.index_time = modified_time(dir.index_file);
+  }
 
   std::string entry_pathname;
 
@@ -1233,6 +4297,10 @@ void cat(const std::string& pathname, std::stack<Entry>& dir_entries, std::vecto
   {
     cFileName.assign(utf8_encode(ffd.cFileName));
 
+    // skip a temporary index file left behind by an interrupted indexer and the tree index database, and the index file with --index-root
+    if (cFileName == ugrep_index_tempname || cFileName == ugrep_tree_filename || cFileName == ugrep_tree_tempname || cFileName == ugrep_grams_filename || cFileName == ugrep_grams_tempname || (!flag_index_root.empty() && cFileName == ugrep_index_filename))
+      continue;
+
     if (pathname.empty() || pathname == ".")
       entry_pathname.assign(cFileName);
     else if (pathname.back() == PATHSEPCHR)
@@ -1250,7 +4318,7 @@ void cat(const std::string& pathname, std::stack<Entry>& dir_entries, std::vecto
     else if ((attr & (FILE_ATTRIBUTE_DIRECTORY|FILE_ATTRIBUTE_DEVICE)) == 0 && cFileName == ugrep_index_filename)
     {
       // get index file modification time
-      index_time = modified_time(ffd);
+      dir.index_time = modified_time(ffd);
     }
     else
     {
@@ -1263,13 +4331,13 @@ void cat(const std::string& pathname, std::stack<Entry>& dir_entries, std::vecto
           // check if this is a dir to index and not a symlink
           if (((ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0 ||
                 ffd.dwReserved0 != IO_REPARSE_TAG_SYMLINK) &&
-              (dir_only || include_dir(entry_pathname.c_str(), cFileName.c_str())))
+              (dir_only || include_dir(ignore.get(), entry_pathname.c_str(), cFileName.c_str())))
           {
-            dir_entries.emplace(entry_pathname, cFileName.size(), modified_time(ffd), file_size(ffd));
+            dir.dir_entries.emplace_back(std::make_shared<Dir>(entry_pathname, cFileName.size(), modified_time(ffd), file_size(ffd), ignore));
           }
           else
           {
-            ++ign_dirs;
+            ++dir.ign_dirs;
           }
         }
         else if ((attr & FILE_ATTRIBUTE_DEVICE) == 0 && !dir_only)
@@ -1278,20 +4346,20 @@ void cat(const std::string& pathname, std::stack<Entry>& dir_entries, std::vecto
           if ((flag_dereference_files ||
                 (ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0 ||
                 ffd.dwReserved0 != IO_REPARSE_TAG_SYMLINK) &&
-              include_file(entry_pathname.c_str(), cFileName.c_str()))
+              include_file(ignore.get(), entry_pathname.c_str(), cFileName.c_str()))
           {
             uint64_t file_time = modified_time(ffd);
-            last_time = std::max(last_time, file_time);
-            file_entries.emplace_back(entry_pathname, cFileName.size(), file_time, file_size(ffd));
+            dir.last_time = std::max(dir.last_time, file_time);
+            dir.file_entries.emplace_back(entry_pathname, cFileName.size(), file_time, file_size(ffd));
           }
           else
           {
-            ++ign_files;
+            ++dir.ign_files;
           }
         }
         else
         {
-          ++num_other;
+          ++dir.num_other;
         }
       }
     }
@@ -1301,124 +4369,339 @@ void cat(const std::string& pathname, std::stack<Entry>& dir_entries, std::vecto
 
 #else
 
+  // stat entries relative to the directory instead of resolving their pathnames
+  int fd = dirfd(dirp);
+
   struct dirent *dirent = NULL;
 
-  while ((dirent = readdir(dir)) != NULL)
+  while ((dirent = readdir(dirp)) != NULL)
   {
+    const char *name = dirent->d_name;
+    bool index_file = strcmp(name, ugrep_index_filename) == 0;
+
+    // skip a temporary index file left behind by an interrupted indexer, the tree index database and the trigram index, and the index file with --index-root
+    if (strcmp(name, ugrep_index_tempname) == 0 ||
+        strcmp(name, ugrep_tree_filename) == 0 ||
+        strcmp(name, ugrep_tree_tempname) == 0 ||
+        strcmp(name, ugrep_grams_filename) == 0 ||
+        strcmp(name, ugrep_grams_tempname) == 0 ||
+        (index_file && !flag_index_root.empty()))
+      continue;
+
+    // skip . and .. and hidden entries by name before stat, except for the index file
+    bool hidden = name[0] == '.' && (!flag_hidden || name[1] == '\0' || name[1] == '.');
+    if (hidden && !index_file)
+      continue;
+
     if (pathname.empty() || pathname == ".")
-      entry_pathname.assign(dirent->d_name);
+      entry_pathname.assign(name);
     else if (pathname.back() == PATHSEPCHR)
-      entry_pathname.assign(pathname).append(dirent->d_name);
+      entry_pathname.assign(pathname).append(name);
     else
-      entry_pathname.assign(pathname).append(PATHSEPSTR).append(dirent->d_name);
-
-    struct stat buf;
+      entry_pathname.assign(pathname).append(PATHSEPSTR).append(name);
 
-    if (lstat(entry_pathname.c_str(), &buf) != 0)
+    // the file type of the entry when known from the directory entry, to exclude entries before stat
+    mode_t mode = 0;
+#if defined(HAVE_STRUCT_DIRENT_D_TYPE)
+    switch (dirent->d_type)
     {
-      error("cannot stat", entry_pathname.c_str());
+      case DT_DIR:  mode = S_IFDIR;  break;
+      case DT_REG:  mode = S_IFREG;  break;
+      case DT_LNK:  mode = S_IFLNK;  break;
+      case DT_FIFO: mode = S_IFIFO;  break;
+      case DT_CHR:  mode = S_IFCHR;  break;
+      case DT_BLK:  mode = S_IFBLK;  break;
+      case DT_SOCK: mode = S_IFSOCK; break;
     }
-    else if (S_ISREG(buf.st_mode) && strcmp(dirent->d_name, ugrep_index_filename) == 0)
+#endif
+
+    struct stat buf;
+    bool stated = false;
+
+    // stat the entry once, unless stat'ed already
+    auto entry_stat = [&]() -> bool {
+      if (!stated)
+      {
+        if (fstatat(fd, name, &buf, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+          error("cannot stat", entry_pathname.c_str());
+          return false;
+        }
+        mode = buf.st_mode;
+        stated = true;
+      }
+      return true;
+    };
+
+    // stat the index file and entries of unknown type, other entries are stat'ed only when included
+    if ((mode == 0 || index_file) && !entry_stat())
+      continue;
+
+    if (S_ISREG(mode) && index_file)
     {
       // get index file modification time
-      index_time = modified_time(buf);
+      dir.index_time = modified_time(buf);
     }
-    else
+    else if (!hidden)
     {
-      // search directory entries that aren't . or .. or hidden
-      if (dirent->d_name[0] != '.' || (flag_hidden && dirent->d_name[1] != '\0' && dirent->d_name[1] != '.'))
+      if (S_ISDIR(mode))
       {
-        if (S_ISDIR(buf.st_mode))
+        if (dir_only || include_dir(ignore.get(), entry_pathname.c_str(), name))
         {
-          if (dir_only || include_dir(entry_pathname.c_str(), dirent->d_name))
-            dir_entries.emplace(entry_pathname, strlen(dirent->d_name), modified_time(buf), file_size(buf));
-          else
-            ++ign_dirs;
+          if (entry_stat())
+            dir.dir_entries.emplace_back(std::make_shared<Dir>(entry_pathname, strlen(name), modified_time(buf), file_size(buf), ignore));
+        }
+        else
+        {
+          ++dir.ign_dirs;
         }
-        else if (S_ISREG(buf.st_mode) && !dir_only)
+      }
+      else if (S_ISREG(mode) && !dir_only)
+      {
+        if (include_file(ignore.get(), entry_pathname.c_str(), name))
         {
-          if (include_file(entry_pathname.c_str(), dirent->d_name))
+          if (entry_stat())
           {
             uint64_t file_time = modified_time(buf);
-            last_time = std::max(last_time, file_time);
-            file_entries.emplace_back(entry_pathname, strlen(dirent->d_name), file_time, file_size(buf));
-          }
-          else
-          {
-            ++ign_files;
+            dir.last_time = std::max(dir.last_time, file_time);
+            dir.file_entries.emplace_back(entry_pathname, strlen(name), file_time, file_size(buf));
           }
         }
-        else if (S_ISLNK(buf.st_mode) && !dir_only)
+        else
+        {
+          ++dir.ign_files;
+        }
+      }
+      else if (S_ISLNK(mode) && !dir_only)
+      {
+        if (flag_dereference_files && fstatat(fd, name, &buf, 0) == 0 && S_ISREG(buf.st_mode))
         {
-          if (flag_dereference_files && stat(entry_pathname.c_str(), &buf) == 0 && S_ISREG(buf.st_mode))
+          if (include_file(ignore.get(), entry_pathname.c_str(), name))
           {
-            if (include_file(entry_pathname.c_str(), dirent->d_name))
-            {
-              uint64_t file_time = modified_time(buf);
-              last_time = std::max(last_time, file_time);
-              file_entries.emplace_back(entry_pathname, strlen(dirent->d_name), file_time, file_size(buf));
-            }
-            else
-            {
-              ++ign_files;
-            }
+            uint64_t file_time = modified_time(buf);
+            dir.last_time = std::max(dir.last_time, file_time);
+            dir.file_entries.emplace_back(entry_pathname, strlen(name), file_time, file_size(buf));
           }
           else
           {
-            ++num_links;
+            ++dir.ign_files;
           }
         }
         else
         {
-          ++num_other;
+          ++dir.num_links;
         }
       }
+      else
+      {
+        ++dir.num_other;
+      }
     }
   }
 
-  closedir(dir);
+  closedir(dirp);
 
 #endif
-
-  for (; !ignore_stack.empty() && !dir_entries.empty() && dir_entries.top().pathname.empty(); dir_entries.pop())
-    ignore_stack.pop();
 }
 
+// walker threads to catalog directories in parallel, each walker has a deque of directories to catalog and steals directories from the other walkers when idle, the main thread visits the directories in depth-first order and catalogs a directory itself when no walker did
+struct Walkers {
+
+  Walkers(size_t num_threads, bool dir_only)
+    :
+      deques(num_threads),
+      dir_only(dir_only),
+      queued(0),
+      ahead(0),
+      max_ahead(64 * num_threads),
+      next(0),
+      quit(false)
+  {
+    for (size_t i = 0; i < num_threads; ++i)
+      threads.emplace_back(&Walkers::execute, this, i);
+  }
+
+  ~Walkers()
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      quit = true;
+    }
+    work.notify_all();
+    for (auto& thread : threads)
+      thread.join();
+  }
+
+  // visit a directory to catalog by the main thread, catalog the directory now unless a walker is cataloging it or catalogued it
+  void visit(Dir& dir)
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (dir.state != Dir::QUEUED)
+      {
+        // wait until the walker catalogued the directory, then let the walkers catalog another directory ahead of the main thread
+        while (dir.state != Dir::DONE)
+          done.wait(lock);
+        --ahead;
+        work.notify_one();
+        return;
+      }
+      dir.state = Dir::BUSY;
+    }
+
+    cat(dir, dir_only);
+
+    // queue the subdirectories round-robin
+    finish(dir, deques.empty() ? 0 : next++ % deques.size(), false);
+  }
+
+  // walker thread loop
+  void execute(size_t id)
+  {
+    while (true)
+    {
+      std::shared_ptr<Dir> dir;
+
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!quit && !take(id, dir))
+          work.wait(lock);
+        if (quit)
+          break;
+      }
+
+      cat(*dir, dir_only);
+
+      finish(*dir, id, true);
+    }
+  }
+
+  // take the next queued directory from the back of our deque or steal one from the front of another deque, skip directories catalogued by the main thread
+  bool take(size_t id, std::shared_ptr<Dir>& dir)
+  {
+    if (ahead >= max_ahead)
+      return false;
+
+    while (queued > 0)
+    {
+      if (!deques[id].empty())
+      {
+        dir = std::move(deques[id].back());
+        deques[id].pop_back();
+      }
+      else
+      {
+        size_t victim = id;
+        do
+          victim = (victim + 1) % deques.size();
+        while (deques[victim].empty());
+        dir = std::move(deques[victim].front());
+        deques[victim].pop_front();
+      }
+
+      --queued;
+
+      if (dir->state == Dir::QUEUED)
+      {
+        dir->state = Dir::BUSY;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // mark the directory catalogued and queue its subdirectories to catalog
+  void finish(Dir& dir, size_t id, bool walker)
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      dir.state = Dir::DONE;
+      ahead += walker;
+      if (!deques.empty())
+      {
+        for (const auto& sub : dir.dir_entries)
+          deques[id].push_back(sub);
+        queued += dir.dir_entries.size();
+      }
+    }
+    if (walker)
+      done.notify_all();
+    if (!dir.dir_entries.empty())
+      work.notify_all();
+  }
+
+  std::vector<std::thread>                      threads;   // walker threads
+  std::vector<std::deque<std::shared_ptr<Dir>>> deques;    // a deque of directories to catalog per walker
+  std::mutex                                    mutex;     // mutex to access the deques and the directory states
+  std::condition_variable                       work;      // cv to notify walkers of queued directories or to quit
+  std::condition_variable                       done;      // cv to notify the main thread of catalogued directories
+  bool                                          dir_only;  // catalog subdirectories only
+  size_t                                        queued;    // number of directories in the deques
+  size_t                                        ahead;     // number of directories catalogued by the walkers not yet visited by the main thread
+  size_t                                        max_ahead; // max number of directories catalogued ahead of the main thread
+  size_t                                        next;      // next deque to queue subdirectories catalogued by the main thread
+  bool                                          quit;      // true when the walkers should quit
+
+};
+
 // recursively delete index files
 void deleter(const char *pathname)
 {
-  std::stack<Entry> dir_entries;
-  std::vector<Entry> file_entries;
+  std::stack<std::shared_ptr<Dir>> dir_entries;
   std::string index_filename;
-  Entry visit;
 
   uint64_t num_dirs = 0;
-  uint64_t num_links = 0;
-  uint64_t num_other = 0;
-  int64_t ign_dirs = 0;
-  int64_t ign_files = 0;
-  uint64_t index_time;
-  uint64_t last_time;
   uint64_t num_removed = 0;
 
+  // walker threads to catalog directories in parallel, no walker threads with -J1
+  size_t num_jobs = flag_jobs > 0 ? flag_jobs : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  Walkers walkers(num_jobs > 1 ? num_jobs : 0, !flag_xattr);
+
   // pathname to the directory tree to index or .
   if (pathname == NULL)
-    dir_entries.emplace();
+    dir_entries.emplace(std::make_shared<Dir>());
   else
-    dir_entries.emplace(pathname);
+    dir_entries.emplace(std::make_shared<Dir>(pathname));
 
-  // recurse subdirectories breadth-first to remove index files
+  // recurse subdirectories depth-first to remove index files
   while (!dir_entries.empty())
   {
-    visit = dir_entries.top();
+    std::shared_ptr<Dir> dir = std::move(dir_entries.top());
     dir_entries.pop();
 
-    cat(visit.pathname, dir_entries, file_entries, num_dirs, num_links, num_other, ign_dirs, ign_files, index_time, last_time, true);
+    walkers.visit(*dir);
+
+    for (const auto& sub : dir->dir_entries)
+      dir_entries.push(sub);
+
+    num_dirs += dir->num_dirs;
+
+    // with --xattr remove the extended attributes of the files and the directory
+    if (dir->xattr)
+    {
+      for (const auto& entry : dir->file_entries)
+        remove_xattr(entry.pathname.c_str(), ugrep_index_xattr);
+
+      if (remove_xattr(dir->visit.pathname.c_str(), ugrep_index_xattr) != 0)
+      {
+        error("cannot remove index attribute of", dir->visit.pathname.c_str());
+      }
+      else
+      {
+        ++num_removed;
+        if (flag_verbose)
+          printf("D%12" PRIu64 " %s\n", num_removed, dir->visit.pathname.c_str());
+      }
+    }
 
     // if index time is nonzero, there is a valid index file in this directory that we should remove
-    if (index_time > 0)
+    if (dir->index_time > 0)
     {
-      index_filename.assign(visit.pathname).append(PATHSEPSTR).append(ugrep_index_filename);
+      if (flag_index_root.empty())
+        index_filename.assign(dir->visit.pathname).append(PATHSEPSTR).append(ugrep_index_filename);
+      else
+        index_filename.assign(dir->index_file);
       if (remove(index_filename.c_str()) != 0)
       {
         error("cannot remove", index_filename.c_str());
@@ -1432,8 +4715,291 @@ void deleter(const char *pathname)
     }
   }
 
-  if (!flag_quiet)
-    printf("\n%13" PRIu64 " indexes removed from %" PRIu64 " directories\n\n", num_removed, num_dirs);
+  // remove the tree index database written with --database and the trigram index written with --trigrams at the root
+  for (const char *filename : { ugrep_tree_filename, ugrep_grams_filename })
+  {
+    if (!flag_index_root.empty())
+    {
+      index_filename = index_root_filename(pathname == NULL ? "." : pathname, filename);
+    }
+    else
+    {
+      index_filename.assign(pathname == NULL ? "." : pathname);
+      if (index_filename.empty() || index_filename.back() != PATHSEPCHR)
+        index_filename.push_back(PATHSEPCHR);
+      index_filename.append(filename);
+    }
+    if (!index_filename.empty() && remove(index_filename.c_str()) == 0)
+    {
+      ++num_removed;
+      if (flag_verbose)
+        printf("D%12" PRIu64 " %s\n", num_removed, index_filename.c_str());
+    }
+  }
+
+  if (!flag_quiet)
+    printf("\n%13" PRIu64 " indexes removed from %" PRIu64 " directories\n\n", num_removed, num_dirs);
+}
+
+// write the indexed parts of the jobs to the index files in the order of the jobs, wait for the next job to complete only when more than max_pending jobs are pending
+void write_batches(Workers& workers, std::deque<Batch>& batches, size_t& pending, size_t max_pending, uint64_t& num_files, int64_t& add_files, int64_t& bin_files, int64_t& not_files, int64_t& zip_files, int64_t& sum_hashes_size, int64_t& sum_files_size, float& sum_noise)
+{
+  while (!batches.empty())
+  {
+    Batch& batch = batches.front();
+
+    // begin the section of the directory in the tree index database with the preserved records, or copy the section of an up-to-date directory
+    if (batch.tree != NULL && !batch.started)
+    {
+      bool ok = batch.tree->begin(batch.base);
+
+      if (batch.copy != NULL)
+      {
+        ok = ok && fwrite(batch.tree->data() + batch.copy->offset, 1, batch.copy->size, batch.index_file) == batch.copy->size;
+      }
+      else
+      {
+        ok = ok && begin_v4(batch.index_file, batch.offset);
+        for (const Record& record : batch.preserved)
+          ok = ok && write_v4_table(batch.index_file, batch.offset, batch.toc, record.header, record.basename.data(), record.basename.size(), record.hashes, record.hashes_size, batch.slices.get()) &&
+            write_v4_blocks(batch.index_file, batch.offset, batch.toc.back(), record.block_size, record.blocks);
+      }
+
+      if (!ok)
+      {
+        error("cannot write index database in", batch.pathname.c_str());
+        batch.tree->ok = false;
+      }
+
+      batch.started = true;
+    }
+
+    while (!batch.jobs.empty())
+    {
+      Job& job = *batch.jobs.front();
+
+      // stop when the next job is not ready, unless too many jobs are pending
+      if (pending <= max_pending && !workers.ready(job))
+        return;
+
+      const char *pathname = job.entry.pathname.c_str();
+      Part part;
+      std::string value;
+
+      while (workers.next(job, part))
+      {
+        size_t hashes_size = part.hashes.size();
+        bool archive = part.archive;
+        bool binary = part.binary;
+        bool compressed = part.compressed;
+        uint64_t size = part.size;
+        float noise = part.noise;
+
+        // binary files registered but not indexed
+        bin_files += binary;
+        not_files += binary && size == 0;
+
+        if (!archive || size > 0)
+        {
+          if (flag_verbose)
+          {
+            int classification = ' ';
+            if (compressed)
+              classification = 'C';
+            if (archive)
+              classification = 'A';
+            if (binary)
+              classification = size == 0 ? 'I' : 'B';
+            if (archive)
+              printf("%c%12" PRIu64 "%3u%% %s{%s}\n", classification, size, static_cast<unsigned>(100.0 * noise + 0.5), pathname, part.partname.c_str());
+            else
+              printf("%c%12" PRIu64 "%3u%% %s\n", classification, size, static_cast<unsigned>(100.0 * noise + 0.5), pathname);
+          }
+
+          // with --trigrams collect the trigrams of the parts of the file, the file is added to the trigram index when all parts are collected
+          if (batch.grams != NULL)
+          {
+            for (uint32_t gram : part.trigrams)
+              batch.grams->set.insert(gram);
+
+            zip_files += archive;
+            ++num_files;
+            add_files += !binary || size != 0;
+            sum_files_size += size;
+            continue;
+          }
+
+          // log2 of the hashes table size, zero to skip empty files and binary files when -I is specified
+          uint8_t logsize = 0;
+          for (size_t k = hashes_size; k > 1; k >>= 1)
+            ++logsize;
+
+          // mark high bits
+          logsize |= (binary << 7) | (archive << 6) | (compressed << 5);
+
+          // the records stored in an extended attribute of a file have no basename
+          const char *basename = job.entry.basename();
+          uint16_t basename_size = batch.xattr ? 0 : static_cast<uint16_t>(std::min(job.entry.basename_size(), static_cast<size_t>(65535)));
+          uint8_t header[4] = {
+            static_cast<uint8_t>((flag_accuracy + '0') | (flag_ignore_case ? ACCURACY_FOLDED : 0)),
+            logsize,
+            static_cast<uint8_t>(basename_size),
+            static_cast<uint8_t>(basename_size >> 8)
+          };
+
+          // the tables of the blocks of a large file indexed in blocks with --blocks are written in format 4
+          std::vector<BlockTable> blocks;
+          if (batch.v4 && !batch.xattr)
+            for (const auto& block : part.blocks)
+              blocks.emplace_back(block.data(), block.size());
+
+          // write header with basename, log of the hashes size and hashes, or the hashes and a table of contents entry in format 4, or add the record to the extended attribute value
+          if (batch.xattr)
+          {
+            value.append(reinterpret_cast<const char*>(header), sizeof(header)).append(reinterpret_cast<const char*>(part.hashes.data()), hashes_size);
+          }
+          else if (batch.v4
+              ? !write_v4_table(batch.index_file, batch.offset, batch.toc, header, basename, basename_size, part.hashes.data(), hashes_size, batch.slices.get()) ||
+                !write_v4_blocks(batch.index_file, batch.offset, batch.toc.back(), 1048576 * static_cast<uint64_t>(flag_blocks), blocks)
+              : (fwrite(header, sizeof(header), 1, batch.index_file) == 0 ||
+                 fwrite(basename, 1, basename_size, batch.index_file) < basename_size ||
+                 (hashes_size > 0 && fwrite(part.hashes.data(), 1, hashes_size, batch.index_file) < hashes_size)))
+          {
+            error("cannot write index file in", batch.pathname.c_str());
+            if (!archive)
+              continue;
+          }
+
+          zip_files += archive;
+          ++num_files;
+          add_files += !binary || hashes_size != 0;
+          sum_files_size += size;
+          sum_noise += noise;
+          sum_hashes_size += sizeof(header) + basename_size + hashes_size;
+          for (const BlockTable& block : blocks)
+            sum_hashes_size += block.hashes_size;
+        }
+      }
+
+      if (job.failed)
+      {
+        error("cannot index", pathname);
+        if (batch.grams != NULL)
+          batch.grams->set.clear();
+      }
+      else if (batch.grams != NULL)
+        batch.grams->add(relative_path(batch.grams->root, job.entry.pathname), job.entry.mtime);
+      else if (batch.xattr && !write_xattr(pathname, value))
+        error("cannot write index attribute of", pathname);
+
+      batch.jobs.pop_front();
+      --pending;
+    }
+
+    // more jobs to come for this directory
+    if (!batch.complete)
+      return;
+
+    // the trigram index is written when all directories are indexed
+    if (batch.grams != NULL)
+    {
+      batches.pop_front();
+      continue;
+    }
+
+    // store the index time in the extended attribute of the directory, then remove the index file it replaces
+    if (batch.xattr)
+    {
+      uint8_t stamp[XATTR_STAMP_SIZE];
+      memset(stamp, 0, sizeof(stamp));
+      memcpy(stamp, ugrep_index_xattr_magic, sizeof(ugrep_index_xattr_magic) - 1);
+      stamp[4] = static_cast<uint8_t>(flag_accuracy + '0');
+      store64(stamp + 8, batch.time);
+
+      if (set_xattr(batch.pathname.c_str(), ugrep_index_xattr, stamp, sizeof(stamp)) != 0)
+        error("cannot write index attribute of", batch.pathname.c_str());
+      else if (!batch.index_filename.empty())
+        remove(batch.index_filename.c_str());
+
+      batches.pop_front();
+      continue;
+    }
+
+    // end the section of the directory in the tree index database, the tree index database is closed when all directories are written
+    if (batch.tree != NULL)
+    {
+      if (batch.copy != NULL
+          ? !batch.tree->end(batch.path, batch.base, batch.copy->time)
+          : !end_v4(batch.index_file, batch.base, batch.offset, batch.toc, batch.slices.get()) || !batch.tree->end(batch.path, batch.base, 0))
+      {
+        error("cannot write index database in", batch.pathname.c_str());
+        batch.tree->ok = false;
+      }
+
+      batches.pop_front();
+      continue;
+    }
+
+    // end a format 4 index file with its table of contents
+    bool ok = !batch.v4 || end_v4(batch.index_file, 0, batch.offset, batch.toc, batch.slices.get());
+
+    // replace the index file with the temporary index file when complete, so the index file is never partially written
+    if ((fclose(batch.index_file) != 0 || !ok) && !batch.temp_filename.empty())
+    {
+      error("cannot write index file in", batch.pathname.c_str());
+      remove(batch.temp_filename.c_str());
+    }
+    else if (!batch.temp_filename.empty() && renamew(batch.temp_filename.c_str(), batch.index_filename.c_str()) != 0)
+    {
+      error("cannot update index file in", batch.pathname.c_str());
+      remove(batch.temp_filename.c_str());
+    }
+
+    batches.pop_front();
+  }
+}
+
+// a tombstone marks the record of a deleted or modified file in an index file with --append, the record is removed when the index file is compacted
+struct Tombstone {
+
+  Tombstone(size_t offset, size_t hashes_offset, size_t hashes_size)
+    :
+      offset(offset),
+      hashes_offset(hashes_offset),
+      hashes_size(hashes_size)
+  { }
+
+  size_t offset;        // offset of the record in the index file
+  size_t hashes_offset; // offset of the hashes of the record in the index file
+  size_t hashes_size;   // number of hashes to clear
+
+};
+
+// mark the records of an index file with tombstones by zeroing their accuracy byte and clearing hashes to all hits, then seek to the end of the index file to append, returns false when failed
+bool write_tombstones(FILE *index_file, const std::vector<Tombstone>& tombstones)
+{
+  static const uint8_t zeros[65536] = { 0 };
+
+  for (const auto& tombstone : tombstones)
+  {
+    if (fseeko(index_file, static_cast<off_t>(tombstone.offset), SEEK_SET) != 0 ||
+        fputc('\0', index_file) == EOF)
+      return false;
+
+    if (tombstone.hashes_size > 0 && fseeko(index_file, static_cast<off_t>(tombstone.hashes_offset), SEEK_SET) != 0)
+      return false;
+
+    // clear the hashes in parts of up to 64KB, tables are larger with --hash-bits
+    for (size_t size = tombstone.hashes_size; size > 0; )
+    {
+      size_t len = std::min<size_t>(size, sizeof(zeros));
+      if (fwrite(zeros, 1, len, index_file) < len)
+        return false;
+      size -= len;
+    }
+  }
+
+  return fseeko(index_file, 0, SEEK_END) == 0;
 }
 
 // recursively index files
@@ -1441,7 +5007,10 @@ void indexer(const char *path)
 {
   if (!flag_no_messages && !flag_check && !flag_quiet)
   {
-    printf("\n> index accuracy: %d (%u%%~%u%% noise)", flag_accuracy, noise_percentage(flag_accuracy + 1), noise_percentage(flag_accuracy));
+    if (flag_trigrams)
+      printf("\n> index engine:   trigrams");
+    else
+      printf("\n> index accuracy: %d (%u%%~%u%% noise)", flag_accuracy, noise_percentage(flag_accuracy + 1), noise_percentage(flag_accuracy));
     printf("\n> decompress:     %s", (flag_decompress ? "yes" : "no"));
     if (flag_decompress)
       printf(" (zmax=%zu)", flag_zmax);
@@ -1450,13 +5019,13 @@ void indexer(const char *path)
       printf("\n> ignore files:   no");
     for (const auto& ignore : flag_ignore_files)
       printf("\n> ignore files:   \"%s\"", ignore.c_str());
-    printf("\n> index hidden:   %s\n\n", (flag_hidden ? "yes" : "no"));
+    printf("\n> index hidden:   %s", (flag_hidden ? "yes" : "no"));
+    printf("\n> index kernel:   %s", kernel->name);
+    printf("\n> index jobs:     %zu\n\n", flag_jobs > 0 ? flag_jobs : std::max<size_t>(std::thread::hardware_concurrency(), 1));
   }
 
-  std::stack<Entry> dir_entries;
-  std::vector<Entry> file_entries;
+  std::stack<std::shared_ptr<Dir>> dir_entries;
   std::string index_filename;
-  Entry visit;
 
   uint64_t num_dirs = 0;
   uint64_t num_files = 0;
@@ -1474,100 +5043,394 @@ void indexer(const char *path)
   int64_t sum_hashes_size = 0;
   int64_t sum_files_size = 0;
   float sum_noise = 0;
-  uint8_t hashes[65536];
+
+  // walker threads to catalog directories and worker threads to index files, no threads with -J1 to catalog directories and index files with the main thread
+  size_t num_jobs = flag_jobs > 0 ? flag_jobs : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  Walkers walkers(num_jobs > 1 ? num_jobs : 0, false);
+  Workers workers(num_jobs > 1 && !flag_check ? num_jobs : 0, flag_readers >= 0 ? static_cast<size_t>(flag_readers) : num_jobs);
+  std::deque<Batch> batches;
+  size_t pending = 0;
+  size_t max_pending = 16 * num_jobs;
 
   // argument path to the directory tree to index or .
   if (path == NULL)
-    dir_entries.emplace();
+    dir_entries.emplace(std::make_shared<Dir>());
   else
-    dir_entries.emplace(path);
+    dir_entries.emplace(std::make_shared<Dir>(path));
+
+  // with --database read and write the tree index database at the root instead of the index files of the directories
+  std::string root(dir_entries.top()->visit.pathname);
+  std::unique_ptr<Tree> tree;
+
+  if (flag_database)
+  {
+    std::string tree_filename;
+    if (!flag_index_root.empty())
+    {
+      tree_filename = index_root_filename(root, ugrep_tree_filename);
+    }
+    else
+    {
+      tree_filename.assign(root);
+      if (tree_filename.empty() || tree_filename.back() != PATHSEPCHR)
+        tree_filename.push_back(PATHSEPCHR);
+      tree_filename.append(ugrep_tree_filename);
+    }
+
+    tree.reset(new Tree());
+    if (tree_filename.empty() || !tree->open(tree_filename, !flag_check))
+    {
+      error("cannot create index database in", root.c_str());
+      return;
+    }
+  }
+
+  // with --trigrams read and update the trigram index at the root instead of the index files of the directories
+  std::unique_ptr<Grams> grams;
+
+  if (flag_trigrams)
+  {
+    std::string grams_filename;
+    if (!flag_index_root.empty())
+    {
+      grams_filename = index_root_filename(root, ugrep_grams_filename);
+    }
+    else
+    {
+      grams_filename.assign(root);
+      if (grams_filename.empty() || grams_filename.back() != PATHSEPCHR)
+        grams_filename.push_back(PATHSEPCHR);
+      grams_filename.append(ugrep_grams_filename);
+    }
+
+    grams.reset(new Grams());
+    if (grams_filename.empty() || !grams->open(root, grams_filename, !flag_check))
+    {
+      error("cannot create trigram index in", root.c_str());
+      return;
+    }
+  }
 
-  // recurse subdirectories
+  // recurse subdirectories depth-first
   while (!dir_entries.empty())
   {
     FILE *index_file = NULL;
-    uint64_t index_time;
-    uint64_t last_time;
+    std::string temp_filename;
 
-    visit = dir_entries.top();
+    // with -v write all indexed files before visiting the next directory, to list the files in the same order as -J1
+    if (flag_verbose)
+      write_batches(workers, batches, pending, 0, num_files, add_files, bin_files, not_files, zip_files, sum_hashes_size, sum_files_size, sum_noise);
+
+    std::shared_ptr<Dir> dir = std::move(dir_entries.top());
     dir_entries.pop();
 
-    cat(visit.pathname, dir_entries, file_entries, num_dirs, num_links, num_other, ign_dirs, ign_files, index_time, last_time);
+    // catalog the directory unless catalogued by a walker
+    walkers.visit(*dir);
 
-    index_filename.assign(visit.pathname).append(PATHSEPSTR).append(ugrep_index_filename);
+    for (const auto& sub : dir->dir_entries)
+      dir_entries.push(sub);
 
-    if (!flag_force)
+    num_dirs += dir->num_dirs;
+    num_links += dir->num_links;
+    num_other += dir->num_other;
+    ign_dirs += dir->ign_dirs;
+    ign_files += dir->ign_files;
+
+    const Entry& visit = dir->visit;
+    std::vector<Entry>& file_entries = dir->file_entries;
+    uint64_t index_time = dir->index_time;
+    uint64_t last_time = dir->last_time;
+
+    // with --trigrams index the new and modified files of the directory with new file IDs in the trigram index
+    if (grams)
     {
-      if (index_time > 0)
+      bool indexed = false;
+      size_t kept = 0;
+
+      for (size_t i = 0; i < file_entries.size(); ++i)
       {
-        // if the index file was the last modified file in this directory, then visit the next directory
-        if (last_time <= index_time && visit.mtime <= index_time)
+        GramsFile *found = grams->find(relative_path(root, file_entries[i].pathname));
+
+        if (found != NULL)
         {
-          num_files += file_entries.size();
+          found->seen = true;
+          indexed = true;
 
-          continue;
+          // if the file was not modified after indexing, then keep it in the trigram index
+          if (found->time == file_entries[i].mtime)
+          {
+            ++num_files;
+            continue;
+          }
+
+          // modified indexed file
+          found->replaced = true;
+          ++mod_files;
+          --add_files;
         }
 
-        if (fopenw_s(&index_file, index_filename.c_str(), flag_check ? "rb" : "r+b") == 0)
+        file_entries[kept++] = file_entries[i];
+      }
+
+      if (!indexed && kept > 0)
+        ++add_dirs;
+
+      file_entries.resize(kept);
+
+      if (!flag_check && !file_entries.empty())
+      {
+        batches.emplace_back(visit.pathname, static_cast<FILE*>(NULL), "", "");
+
+        Batch& batch = batches.back();
+        batch.grams = grams.get();
+
+        for (const auto& entry : file_entries)
         {
-          char check_magic[sizeof(ugrep_index_file_magic)];
+          batch.jobs.emplace_back(new Job(entry));
+          ++pending;
+          workers.submit(batch.jobs.back().get());
 
-          if (fread(check_magic, sizeof(ugrep_index_file_magic), 1, index_file) != 0 &&
-              memcmp(check_magic, ugrep_index_file_magic, sizeof(ugrep_index_file_magic)) == 0)
-          {
-            uint8_t header[4];
-            char basename[65536];
-            off_t inpos = sizeof(ugrep_index_file_magic);
-            off_t outpos = sizeof(ugrep_index_file_magic);
+          write_batches(workers, batches, pending, max_pending, num_files, add_files, bin_files, not_files, zip_files, sum_hashes_size, sum_files_size, sum_noise);
+        }
+
+        batch.complete = true;
+
+        write_batches(workers, batches, pending, max_pending, num_files, add_files, bin_files, not_files, zip_files, sum_hashes_size, sum_files_size, sum_noise);
+      }
+      else
+      {
+        add_files += file_entries.size();
+      }
+
+      continue;
+    }
 
-            std::vector<Entry>::iterator archive_entry = file_entries.end();
+    // the index file in the directory or stored under DIR with --index-root=DIR
+    if (flag_index_root.empty())
+      index_filename.assign(visit.pathname).append(PATHSEPSTR).append(ugrep_index_filename);
+    else
+      index_filename.assign(dir->index_file);
+
+    if (index_filename.empty() && !flag_database)
+    {
+      error("cannot identify directory", visit.pathname.c_str());
+      add_files += file_entries.size();
+      continue;
+    }
+
+    // the format of the index file to write, index files are updated in their format unless --format is specified
+    int format = flag_format == 4 ? 4 : 3;
+    uint64_t offset = 0;
+    std::vector<TocEntry> toc;
+    std::unique_ptr<Slices> slices(flag_slices > 0 ? new Slices(flag_slices) : NULL);
+    bool keep = false;
+
+    // the section of the directory in the tree index database with the time it was written and the records it preserves
+    std::string tree_path;
+    const TreeEntry *section = NULL;
+    std::vector<Record> tree_records;
+
+    if (tree)
+    {
+      tree_path = relative_path(root, visit.pathname);
+      section = tree->find(tree_path);
+      index_time = section != NULL ? section->time : 0;
+    }
+
+    // with --xattr store the records of the files in their extended attributes, unless the file system does not support extended attributes
+    bool xattr = false;
+
+    if (flag_xattr && !tree)
+    {
+      if (dir->xattr)
+      {
+        xattr = true;
+        index_time = dir->xattr_time;
+      }
+      else if (!flag_check)
+      {
+        // probe the file system with an extended attribute of the directory with a zero index time, or fall back to the index file
+        uint8_t stamp[XATTR_STAMP_SIZE];
+        memset(stamp, 0, sizeof(stamp));
+        memcpy(stamp, ugrep_index_xattr_magic, sizeof(ugrep_index_xattr_magic) - 1);
+        if (set_xattr(visit.pathname.c_str(), ugrep_index_xattr, stamp, sizeof(stamp)) == 0)
+        {
+          xattr = true;
+          index_time = 0;
+        }
+      }
+    }
+
+    if (xattr)
+    {
+      // if the files were indexed and none were modified after indexing, then visit the next directory
+      if (!flag_force && index_time > 0 && last_time <= index_time && visit.mtime <= index_time)
+      {
+        num_files += file_entries.size();
 
-            while (true)
+        continue;
+      }
+
+      if (flag_force || index_time == 0)
+        ++add_dirs;
+
+      if (!flag_force)
+      {
+        // preserve the records stored in the extended attributes of the files that were not modified after indexing
+        std::string value;
+        size_t kept = 0;
+
+        for (size_t i = 0; i < file_entries.size(); ++i)
+        {
+          if (read_xattr(file_entries[i].pathname.c_str(), value))
+          {
+            if (file_entries[i].mtime <= index_time)
             {
-              if (fseeko(index_file, inpos, SEEK_SET) != 0 ||
-                  fread(header, sizeof(header), 1, index_file) == 0)
-                break;
+              for (size_t pos = 0; pos + 4 <= value.size(); )
+              {
+                const uint8_t *header = reinterpret_cast<const uint8_t*>(value.data() + pos);
+                size_t hashes_size = table_size(header[1]);
+                bool binary = (header[1] & 0x80) != 0;
 
-              // hashes table size, zero to skip empty files and binary files when -I is specified
-              size_t hashes_size = 0;
-              uint8_t logsize = header[1] & 0x1f;
-              if (logsize > 0)
-                for (hashes_size = 1; logsize > 0; --logsize)
-                  hashes_size <<= 1;
+                ++num_files;
 
-              // sanity check
-              if (hashes_size > 65536)
-                break;
+                // binary files registered but not indexed
+                bin_files += binary;
+                not_files += binary && hashes_size == 0;
 
-              uint16_t basename_size = header[2] | (header[3] << 8);
-              if (fread(basename, 1, basename_size, index_file) < basename_size)
-                break;
+                pos += 4 + (header[2] | (header[3] << 8)) + hashes_size;
+              }
+
+              continue;
+            }
+
+            // modified indexed file
+            ++mod_files;
+            --add_files;
+          }
+
+          file_entries[kept++] = file_entries[i];
+        }
+
+        file_entries.resize(kept);
+      }
+    }
+    else if (!flag_force)
+    {
+      if (index_time > 0)
+      {
+        // if the index file was the last modified file in this directory, then visit the next directory, unless converting the index file with --format or --slices
+        size_t index_slices = 0;
+        if (last_time <= index_time && visit.mtime <= index_time && (tree || flag_format == 0 || (index_format(index_filename.c_str(), index_slices) == flag_format && index_slices == flag_slices)))
+        {
+          num_files += file_entries.size();
+
+          // copy the section of the directory to the tree index database
+          if (tree && !flag_check)
+          {
+            batches.emplace_back(visit.pathname, tree->file, "", "");
+            Batch& batch = batches.back();
+            batch.tree = tree.get();
+            batch.path.swap(tree_path);
+            batch.copy = section;
+            batch.complete = true;
+
+            write_batches(workers, batches, pending, max_pending, num_files, add_files, bin_files, not_files, zip_files, sum_hashes_size, sum_files_size, sum_noise);
+          }
+
+          continue;
+        }
+
+        std::unique_ptr<uint8_t[]> index;
+        const uint8_t *index_data = NULL;
+        size_t index_size = 0;
 
-              // properly terminate
-              basename[basename_size] = '\0';
+        if (tree)
+        {
+          // reconcile the section of the directory in the tree index database, which is in memory
+          index_data = tree->data() + section->offset;
+          index_size = static_cast<size_t>(section->size);
+        }
+        else if (fopenw_s(&index_file, index_filename.c_str(), "rb") == 0)
+        {
+          // read the index file at once to reconcile its records with the directory contents in memory
+          size_t index_capacity = static_cast<size_t>(file_size(fileno(index_file)));
+          index.reset(new uint8_t[index_capacity + 1]);
+          index_size = fread(index.get(), 1, index_capacity, index_file);
+          index_data = index.get();
+
+          fclose(index_file);
+          index_file = NULL;
+        }
+
+        if (index_data != NULL)
+        {
+          std::vector<Record> records;
+          bool torn = false;
+          int old_format = read_records(index_data, index_size, records, torn);
 
-              std::vector<Entry>::iterator entry = archive_entry;
+          if (old_format != 0)
+          {
+            if (flag_format == 0)
+              format = old_format;
+
+            // the file entries sorted by basename to find indexed files by binary search, found entries are removed after reconciling
+            std::vector<size_t> sorted(file_entries.size());
+            for (size_t i = 0; i < sorted.size(); ++i)
+              sorted[i] = i;
+            std::sort(sorted.begin(), sorted.end(), [&](size_t i, size_t j) { return strcmp(file_entries[i].basename(), file_entries[j].basename()) < 0; });
+            std::vector<char> removed(file_entries.size());
+            const size_t none = file_entries.size();
+            size_t archive_entry = none;
+
+            // the records to preserve, the records of deleted and modified files to mark with tombstones, the garbage bytes of these records and the dead bytes of tombstones
+            std::vector<const Record*> preserved;
+            std::vector<Tombstone> tombstones;
+            size_t garbage = 0;
+            size_t dead = 0;
+
+            for (const Record& record : records)
+            {
+              const uint8_t *header = record.header;
+              const char *basename = record.basename.c_str();
+              size_t basename_size = record.basename.size();
+              size_t hashes_size = record.hashes_size;
+              size_t record_size = record.size;
+
+              // skip a tombstone of a deleted or modified file written with --append
+              if (header[0] == '\0')
+              {
+                dead += record_size;
+                continue;
+              }
+
+              size_t entry = archive_entry;
 
               // if not the same archive filename, then remove the postponed archive entry from the cat file entries
-              if (entry != file_entries.end() &&
-                  (entry->basename_size() != basename_size ||
-                   strncmp(entry->basename(), basename, basename_size) != 0))
+              if (entry != none &&
+                  (file_entries[entry].basename_size() != basename_size ||
+                   strncmp(file_entries[entry].basename(), basename, basename_size) != 0))
               {
-                file_entries.erase(entry);
-                entry = archive_entry = file_entries.end();
+                removed[entry] = true;
+                entry = archive_entry = none;
               }
 
               // search the directory contents to find the indexed file
-              if (entry == file_entries.end())
-                for (entry = file_entries.begin(); entry != file_entries.end(); ++entry)
-                  if (entry->basename_size() == basename_size && strncmp(entry->basename(), basename, basename_size) == 0)
-                    break;
+              if (entry == none)
+              {
+                auto found = std::lower_bound(sorted.begin(), sorted.end(), basename, [&](size_t i, const char *name) { return strcmp(file_entries[i].basename(), name) < 0; });
+                if (found != sorted.end() &&
+                    !removed[*found] &&
+                    file_entries[*found].basename_size() == basename_size &&
+                    strncmp(file_entries[*found].basename(), basename, basename_size) == 0)
+                  entry = *found;
+              }
 
               bool archive = (header[1] & 0x40) != 0;
               bool binary = (header[1] & 0x80) != 0;
 
               // if file is present in the directory and not updated, then preserve entry in the index
-              if (entry != file_entries.end() && entry->mtime <= index_time)
+              if (entry != none && file_entries[entry].mtime <= index_time)
               {
                 ++num_files;
 
@@ -1575,21 +5438,7 @@ void indexer(const char *path)
                 bin_files += binary;
                 not_files += binary && hashes_size == 0;
 
-                if (inpos > outpos)
-                {
-                  if (fread(hashes, 1, hashes_size, index_file) < hashes_size)
-                    break;
-
-                  // move header, basename, and hashes to the front of the index file (only happens when not just checking)
-                  if (fseeko(index_file, outpos, SEEK_SET) != 0 ||
-                      fwrite(header, sizeof(header), 1, index_file) == 0 ||
-                      fwrite(basename, 1, basename_size, index_file) < basename_size ||
-                      fwrite(hashes, 1, hashes_size, index_file) < hashes_size)
-                  {
-                    error("cannot update index file in", visit.pathname.c_str());
-                    break;
-                  }
-                }
+                preserved.push_back(&record);
 
                 // remove file entry from the cat file entries unless multi-part archive
                 if (archive)
@@ -1599,26 +5448,22 @@ void indexer(const char *path)
                 }
                 else
                 {
-                  file_entries.erase(entry);
-                  archive_entry = file_entries.end();
+                  removed[entry] = true;
+                  archive_entry = none;
                 }
-
-                outpos += sizeof(header) + basename_size + hashes_size;
               }
-              else if (entry == file_entries.end())
+              else if (entry == none)
               {
                 ++del_files;
 
-                if (flag_check)
-                {
-                  outpos += sizeof(header) + basename_size + hashes_size;
-                }
-                else
+                if (!flag_check)
                 {
                   if (flag_verbose)
                     printf("D           -  -%% %s\n", basename);
 
-                  sum_hashes_size -= sizeof(header) + basename_size + hashes_size;
+                  // clear the hashes of the deleted file, so the tombstone never makes ugrep skip a new file with the same name
+                  tombstones.emplace_back(record.offset, record.offset + 4 + basename_size, hashes_size);
+                  garbage += record_size;
                 }
               }
               else
@@ -1630,34 +5475,103 @@ void indexer(const char *path)
                   --add_files;
                 }
 
-                if (flag_check)
+                if (!flag_check)
                 {
-                  outpos += sizeof(header) + basename_size + hashes_size;
+                  // clear the hashes of the modified file, so the tombstone never makes ugrep skip the file
+                  tombstones.emplace_back(record.offset, record.offset + 4 + basename_size, hashes_size);
+                  garbage += record_size;
                 }
-                else
+              }
+            }
+
+            // make sure to remove postponed archive file entry
+            if (archive_entry != none)
+              removed[archive_entry] = true;
+
+            // remove the file entries found in the index, keeping the other entries to index in order
+            size_t kept = 0;
+            for (size_t i = 0; i < file_entries.size(); ++i)
+              if (!removed[i])
+                file_entries[kept++] = file_entries[i];
+            file_entries.resize(kept);
+
+            if (!flag_check && tree)
+            {
+              // the preserved records are written to the section of the directory in the tree index database
+              sum_hashes_size -= garbage + dead;
+              for (const Record *record : preserved)
+                tree_records.push_back(*record);
+            }
+            else if (!flag_check)
+            {
+              // rewrite a format 4 index file and convert the format with --format, compact a format 3 index file when records were removed, but with --append only when the index file has too much garbage
+              bool compact = torn || format != old_format || format == 4 || (garbage + dead > 0 && (flag_append == 0 || 100 * (garbage + dead) > flag_append * index_size));
+
+              if (format == 4 && old_format == 4 && !torn && garbage + dead == 0 && file_entries.empty() && load32(index_data + 36) == flag_slices)
+              {
+                // keep the format 4 index file when no files were removed or added
+                compact = false;
+                keep = true;
+              }
+              else if (!compact && !tombstones.empty())
+              {
+                // with --append mark the records of deleted and modified files with tombstones, then append the indexed files
+                if (fopenw_s(&index_file, index_filename.c_str(), "r+b") != 0 || !write_tombstones(index_file, tombstones))
                 {
-                  sum_hashes_size -= sizeof(header) + basename_size + hashes_size;
+                  if (index_file != NULL)
+                    fclose(index_file);
+                  index_file = NULL;
+                  compact = true;
                 }
               }
+              else if (!compact)
+              {
+                // append the indexed files to the index file
+                compact = fopenw_s(&index_file, index_filename.c_str(), "ab") != 0;
+              }
 
-              inpos += sizeof(header) + basename_size + hashes_size;
-            }
+              if (compact)
+              {
+                sum_hashes_size -= garbage + dead;
 
-            // make sure to remove postponed archive file entry
-            if (archive_entry != file_entries.end())
-              file_entries.erase(archive_entry);
+                // write the preserved records to a temporary index file that replaces the index file when complete, with one write in format 3
+                temp_filename.assign(index_filename).append(".tmp");
+                bool ok = fopenw_s(&index_file, temp_filename.c_str(), "wb") == 0;
+
+                if (format == 4)
+                {
+                  ok = ok && begin_v4(index_file, offset);
+                  for (const Record *record : preserved)
+                    ok = ok && write_v4_table(index_file, offset, toc, record->header, record->basename.c_str(), record->basename.size(), record->hashes, record->hashes_size, slices.get()) &&
+                      write_v4_blocks(index_file, offset, toc.back(), record->block_size, record->blocks);
+                }
+                else
+                {
+                  std::string buffer(ugrep_index_file_magic, sizeof(ugrep_index_file_magic));
+                  for (const Record *record : preserved)
+                    buffer.append(reinterpret_cast<const char*>(record->header), sizeof(record->header)).append(record->basename).append(reinterpret_cast<const char*>(record->hashes), record->hashes_size);
+                  ok = ok && fwrite(buffer.data(), 1, buffer.size(), index_file) == buffer.size();
+                }
 
-            if (inpos > outpos &&
-                (fseeko(index_file, outpos, SEEK_SET) != 0 ||
-                 ftruncate(fileno(index_file), outpos) != 0))
-              error("cannot update index file in", visit.pathname.c_str());
+                if (!ok)
+                {
+                  error("cannot update index file in", visit.pathname.c_str());
+                  if (index_file != NULL)
+                  {
+                    fclose(index_file);
+                    remove(temp_filename.c_str());
+                  }
+                  index_file = NULL;
+                  temp_filename.clear();
+                  toc.clear();
+                  slices.reset(flag_slices > 0 ? new Slices(flag_slices) : NULL);
+                }
+              }
+            }
           }
           else
           {
             ++add_dirs;
-
-            fclose(index_file);
-            index_file = NULL;
           }
         }
         else
@@ -1671,101 +5585,67 @@ void indexer(const char *path)
       }
     }
 
-    // create a new index file when none is present
-    if (index_file == NULL && !flag_check)
+    // create a new index file when none is present, written to a temporary index file that replaces the index file when complete
+    if (index_file == NULL && !keep && !tree && !xattr && !flag_check)
     {
-      if (fopenw_s(&index_file, index_filename.c_str(), "wb") != 0 ||
-          fwrite(ugrep_index_file_magic, sizeof(ugrep_index_file_magic), 1, index_file) == 0)
+      temp_filename.assign(index_filename).append(".tmp");
+      if (fopenw_s(&index_file, temp_filename.c_str(), "wb") != 0 ||
+          (format == 4
+           ? !begin_v4(index_file, offset)
+           : fwrite(ugrep_index_file_magic, sizeof(ugrep_index_file_magic), 1, index_file) == 0))
       {
         error("cannot create index file in", visit.pathname.c_str());
         if (index_file != NULL)
+        {
           fclose(index_file);
+          remove(temp_filename.c_str());
+        }
         index_file = NULL;
+        temp_filename.clear();
       }
     }
 
-    if (index_file != NULL && !flag_check)
+    if ((index_file != NULL || tree || xattr) && !flag_check)
     {
-      Stream stream;
-
-      for (const auto& entry : file_entries)
+      // index the files with the workers, the index file is closed when all indexed files are written
+      batches.emplace_back(visit.pathname, tree ? tree->file : index_file, temp_filename, index_filename);
+      index_file = NULL;
+
+      Batch& batch = batches.back();
+      batch.v4 = format == 4 || tree;
+      batch.offset = offset;
+      batch.toc.swap(toc);
+      if (batch.v4)
+        batch.slices.swap(slices);
+
+      if (tree)
       {
-        size_t hashes_size = 0;
-        float noise = 0;
-        bool binary = false;
+        batch.tree = tree.get();
+        batch.path.swap(tree_path);
+        batch.preserved.swap(tree_records);
+      }
 
-        // if the file is a a zip archive, then index archived content for each part
-        bool archive = false;
-        bool compressed = false;
-        uint64_t size = entry.size;
-        const char *pathname = entry.pathname.c_str();
+      // with --xattr the index time is the time the directory was catalogued, the index file is removed when present
+      if (xattr)
+      {
+        batch.xattr = true;
+        batch.time = dir->visit_time;
+        if (dir->index_time == 0)
+          batch.index_filename.clear();
+      }
 
-        if (size == 0 || index(stream, pathname, hashes, hashes_size, noise, compressed, archive, binary, size))
-        {
-          do
-          {
-            // binary files registered but not indexed
-            bin_files += binary;
-            not_files += binary && size == 0;
+      for (const auto& entry : file_entries)
+      {
+        batch.jobs.emplace_back(new Job(entry));
+        ++pending;
+        workers.submit(batch.jobs.back().get());
 
-            if (!archive || size > 0)
-            {
-              if (flag_verbose)
-              {
-                int classification = ' ';
-                if (compressed)
-                  classification = 'C';
-                if (archive)
-                  classification = 'A';
-                if (binary)
-                  classification = size == 0 ? 'I' : 'B';
-                if (archive)
-                  printf("%c%12" PRIu64 "%3u%% %s{%s}\n", classification, size, static_cast<unsigned>(100.0 * noise + 0.5), pathname, stream.partname.c_str());
-                else
-                  printf("%c%12" PRIu64 "%3u%% %s\n", classification, size, static_cast<unsigned>(100.0 * noise + 0.5), pathname);
-              }
+        write_batches(workers, batches, pending, max_pending, num_files, add_files, bin_files, not_files, zip_files, sum_hashes_size, sum_files_size, sum_noise);
+      }
 
-              // log2 of the hashes table size, zero to skip empty files and binary files when -I is specified
-              uint8_t logsize = 0;
-              for (size_t k = hashes_size; k > 1; k >>= 1)
-                ++logsize;
-
-              // mark high bits
-              logsize |= (binary << 7) | (archive << 6) | (compressed << 5);
-
-              const char *basename = entry.basename();
-              uint16_t basename_size = static_cast<uint16_t>(std::min(entry.basename_size(), static_cast<size_t>(65535)));
-              uint8_t header[4] = {
-                static_cast<uint8_t>(flag_accuracy + '0'),
-                logsize,
-                static_cast<uint8_t>(basename_size),
-                static_cast<uint8_t>(basename_size >> 8)
-              };
-
-              // write header with basename, log of the hashes size and hashes
-              if (fwrite(header, sizeof(header), 1, index_file) == 0 ||
-                  fwrite(basename, 1, basename_size, index_file) < basename_size ||
-                  fwrite(hashes, 1, hashes_size, index_file) < hashes_size)
-              {
-                error("cannot write index file in", visit.pathname.c_str());
-                if (!archive)
-                  break;
-              }
+      batch.complete = true;
 
-              zip_files += archive;
-              ++num_files;
-              add_files += !binary || hashes_size != 0;
-              sum_files_size += size;
-              sum_noise += noise;
-              sum_hashes_size += sizeof(header) + basename_size + hashes_size;
-            }
-          } while (archive && index(stream, pathname, hashes, hashes_size, noise, compressed, archive, binary, size));
-        }
-        else
-        {
-          error("cannot index", pathname);
-        }
-      }
+      write_batches(workers, batches, pending, max_pending, num_files, add_files, bin_files, not_files, zip_files, sum_hashes_size, sum_files_size, sum_noise);
     }
     else
     {
@@ -1776,6 +5656,34 @@ void indexer(const char *path)
       fclose(index_file);
   }
 
+  // write the remaining indexed files
+  write_batches(workers, batches, pending, 0, num_files, add_files, bin_files, not_files, zip_files, sum_hashes_size, sum_files_size, sum_noise);
+
+  // write the manifest of the tree index database and replace the tree index database
+  if (tree && !flag_check && !tree->close())
+    error("cannot write index database in", root.c_str());
+
+  // remove the files that are no longer present from the trigram index, then write the manifest of the trigram index
+  if (grams)
+  {
+    del_files += grams->deleted();
+
+    if (flag_verbose && !flag_check)
+      for (const GramsFile& entry : grams->files)
+        if (!entry.seen)
+          printf("D           -  -%% %s\n", entry.path.c_str());
+
+    if (!flag_check)
+    {
+      int64_t old_size = static_cast<int64_t>(grams->size);
+
+      if (!grams->close())
+        error("cannot write trigram index in", root.c_str());
+
+      sum_hashes_size += static_cast<int64_t>(grams->size) - old_size;
+    }
+  }
+
   if (sum_files_size > 0)
   {
     if (flag_verbose)
@@ -1793,7 +5701,7 @@ void indexer(const char *path)
         printf("%13" PRIu64 " directories ignored with --ignore-files\n%13" PRIu64 " files ignored with --ignore-files\n", ign_dirs, ign_files);
       printf("%13" PRIu64 " symbolic links skipped\n%13" PRIu64 " devices skipped\n", num_links, num_other);
       if (warnings > 0)
-        printf("%13zu warnings and errors\n", warnings);
+        printf("%13zu warnings and errors\n", warnings.load());
       if (add_dirs == 0 && add_files == 0 && mod_files == 0 && del_files == 0)
         printf("\nChecked: indexes are fresh and up to date\n\n");
       else
@@ -1812,7 +5720,7 @@ void indexer(const char *path)
       printf("%13" PRIu64 " directories ignored with --ignore-files\n%13" PRIu64 " files ignored with --ignore-files\n", ign_dirs, ign_files);
     printf("%13" PRIu64 " symbolic links skipped\n%13" PRIu64 " devices skipped\n", num_links, num_other);
     if (!flag_quiet && warnings > 0)
-      printf("%13zu warnings and errors\n", warnings);
+      printf("%13zu warnings and errors\n", warnings.load());
     if (sum_hashes_size > 0)
       printf("%13" PRId64 " bytes indexing storage increase at %" PRId64 " bytes/file\n\n", sum_hashes_size, sum_hashes_size / num_files);
     else
@@ -1853,8 +5761,16 @@ void options(int argc, const char **argv)
 
             if (strncmp(arg, "accuracy=", 9) == 0 && isdigit(arg[9]))
               flag_accuracy = arg[9] - '0';
+            else if (strcmp(arg, "append") == 0)
+              flag_append = DEFAULT_APPEND;
+            else if (strncmp(arg, "append=", 7) == 0)
+              flag_append = strtopos(arg + 7, "invalid argument --append=");
+            else if (strncmp(arg, "blocks=", 7) == 0)
+              flag_blocks = strtopos(arg + 7, "invalid argument --blocks=");
             else if (strcmp(arg, "check") == 0)
               flag_check = true;
+            else if (strcmp(arg, "database") == 0)
+              flag_database = true;
             else if (strcmp(arg, "decompress") == 0)
               flag_decompress = true;
             else if (strcmp(arg, "delete") == 0)
@@ -1863,26 +5779,65 @@ void options(int argc, const char **argv)
               flag_dereference_files = true;
             else if (strcmp(arg, "force") == 0)
               flag_force = true;
+            else if (strncmp(arg, "format=", 7) == 0)
+            {
+              flag_format = static_cast<int>(strtonum(arg + 7, "invalid argument --format="));
+              if (flag_format != 3 && flag_format != 4)
+                usage("invalid argument --format=", arg + 7);
+            }
+            else if (strncmp(arg, "hash-bits=", 10) == 0)
+            {
+              flag_hash_bits = strtonum(arg + 10, "invalid argument --hash-bits=");
+              if (flag_hash_bits < 16 || flag_hash_bits > HASH_MAX_BITS)
+                usage("invalid argument --hash-bits=", arg + 10);
+            }
             else if (strcmp(arg, "help") == 0)
               help();
             else if (strcmp(arg, "hidden") == 0)
               flag_hidden = true;
             else if (strcmp(arg, "ignore-binary") == 0)
               flag_ignore_binary = true;
+            else if (strcmp(arg, "ignore-case") == 0)
+              flag_ignore_case = true;
             else if (strcmp(arg, "ignore-files") == 0)
               flag_ignore_files.emplace_back(DEFAULT_IGNORE_FILE);
             else if (strncmp(arg, "ignore-files=", 13) == 0)
               flag_ignore_files.emplace_back(arg + 13);
+            else if (strncmp(arg, "index-root=", 11) == 0)
+              flag_index_root.assign(arg + 11);
+            else if (strncmp(arg, "jobs=", 5) == 0)
+              flag_jobs = strtonum(arg + 5, "invalid argument --jobs=");
+            else if (strncmp(arg, "kernel=", 7) == 0)
+            {
+              if (!select_kernel(arg + 7))
+                usage("invalid or unsupported argument --kernel=", arg + 7);
+            }
+            else if (strcmp(arg, "no-cache") == 0)
+              flag_no_cache = true;
             else if (strcmp(arg, "no-messages") == 0)
               flag_no_messages = true;
             else if (strcmp(arg, "quiet") == 0)
               flag_quiet = flag_no_messages = true;
+            else if (strncmp(arg, "readers=", 8) == 0)
+              flag_readers = static_cast<int>(strtonum(arg + 8, "invalid argument --readers="));
+            else if (strcmp(arg, "self-test") == 0)
+              flag_self_test = true;
             else if (strcmp(arg, "silent") == 0)
               flag_quiet = flag_no_messages = true;
+            else if (strncmp(arg, "slices=", 7) == 0)
+            {
+              flag_slices = strtonum(arg + 7, "invalid argument --slices=");
+              if (flag_slices != 64 && flag_slices != 256 && flag_slices != 512)
+                usage("invalid argument --slices=", arg + 7);
+            }
+            else if (strcmp(arg, "trigrams") == 0)
+              flag_trigrams = true;
             else if (strcmp(arg, "verbose") == 0)
               flag_verbose = true;
             else if (strcmp(arg, "version") == 0)
               version();
+            else if (strcmp(arg, "xattr") == 0)
+              flag_xattr = true;
             else if (strncmp(arg, "zmax=", 5) == 0)
               flag_zmax = strtopos(arg + 5, "invalid argument --zmax=");
             else
@@ -1906,6 +5861,16 @@ void options(int argc, const char **argv)
             flag_ignore_binary = true;
             break;
 
+          case 'J':
+            is_grouped = false;
+            if (*++arg != '\0')
+              flag_jobs = strtonum(arg, "invalid argument -J ");
+            else if (++i < argc)
+              flag_jobs = strtonum(argv[i], "invalid argument -J ");
+            else
+              usage("missing NUM argument for option -J");
+            break;
+
           case 'q':
             flag_quiet = flag_no_messages = true;
             break;
@@ -2058,10 +6023,71 @@ int main(int argc, const char **argv)
   signal(SIGPIPE, SIG_IGN);
 #endif
 
+#if !defined(OS_WIN)
+  // recover from SIGBUS when a mapped file is truncated while hashing the file
+  signal(SIGBUS, sigbus_handler);
+#endif
+
+  // select the fastest indexing kernel supported by the CPU, unless overridden with --kernel
+  select_kernel("auto");
+
   load_config(ugrep_indexer_config_filename);
 
   options(argc, argv);
 
+  if (flag_self_test)
+    self_test();
+
+  // option --slices writes format 4 index files
+  if (flag_slices > 0)
+  {
+    if (flag_format == 3)
+      usage("option --slices requires --format=4");
+    flag_format = 4;
+  }
+
+  // option --hash-bits larger than 16 writes format 4 index files, because ugrep --index searches format 3 index files with 16-bit hashes
+  // that only probe the same bits as the wide hashes of a table of up to 64KB
+  if (flag_hash_bits > 16)
+  {
+    if (flag_format == 3)
+      usage("option --hash-bits requires --format=4");
+    flag_format = 4;
+  }
+
+  // option --blocks writes format 4 index files
+  if (flag_blocks > 0)
+  {
+    if (flag_format == 3)
+      usage("option --blocks requires --format=4");
+    flag_format = 4;
+  }
+
+  // option --ignore-case writes format 4 index files, because ugrep --index searches format 3 index files with hashes of n-grams that are not case-folded
+  if (flag_ignore_case)
+  {
+    if (flag_format == 3)
+      usage("option --ignore-case requires --format=4");
+    flag_format = 4;
+  }
+
+  // option --trigrams writes the trigram index at the root instead of index files
+  if (flag_trigrams && (flag_database || flag_xattr))
+    usage("option --trigrams cannot be used with --database or --xattr");
+
+  // with --index-root=DIR store the index files under DIR, named by the directories and the absolute pathname of the directory tree
+  if (!flag_index_root.empty())
+  {
+    tree_root.assign(arg_path != NULL ? arg_path : ".");
+    tree_root_real = real_pathname(tree_root);
+
+    if (!flag_check && !flag_delete && makedir(flag_index_root.c_str()) != 0 && errno != EEXIST)
+    {
+      error("cannot create directory", flag_index_root.c_str());
+      exit(EXIT_FAILURE);
+    }
+  }
+
   if (flag_delete)
     deleter(arg_path);
   else
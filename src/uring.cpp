@@ -0,0 +1,360 @@
+/******************************************************************************\
+* Copyright (c) 2023, Robert van Engelen, Genivia Inc. All rights reserved.    *
+*                                                                              *
+* Redistribution and use in source and binary forms, with or without           *
+* modification, are permitted provided that the following conditions are met:  *
+*                                                                              *
+*   (1) Redistributions of source code must retain the above copyright notice, *
+*       this list of conditions and the following disclaimer.                  *
+*                                                                              *
+*   (2) Redistributions in binary form must reproduce the above copyright      *
+*       notice, this list of conditions and the following disclaimer in the    *
+*       documentation and/or other materials provided with the distribution.   *
+*                                                                              *
+*   (3) The name of the author may not be used to endorse or promote products  *
+*       derived from this software without specific prior written permission.  *
+*                                                                              *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF         *
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO   *
+* EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,       *
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, *
+* PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;  *
+* OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,     *
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR      *
+* OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF       *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                                   *
+\******************************************************************************/
+
+/**
+@file      uring.cpp
+@brief     batched file reads with io_uring
+@author    Robert van Engelen - engelen@genivia.com
+@copyright (c) 2023-2025, Robert van Engelen, Genivia Inc. All rights reserved.
+@copyright (c) BSD-3 License - see LICENSE.txt
+*/
+
+//  A batch of small files is read in three rounds of submissions to the
+//  io_uring: the files are opened, then read, then closed, each round with one
+//  io_uring_enter() system call to submit all requests and wait for their
+//  completions, instead of at least four system calls per file.  The raw
+//  io_uring system calls are used, so liburing is not required.  Linux 5.6 or
+//  greater is required to open and close files with io_uring, which is
+//  checked with the IORING_FEAT_RW_CUR_POS feature that 5.6 introduced.
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "uring.hpp"
+
+#if defined(HAVE_LINUX_IO_URING_H)
+# include <linux/io_uring.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_FEAT_RW_CUR_POS)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+struct Uring::Ring {
+
+  int                  fd;       // the io_uring file descriptor
+  void                *sq_ptr;   // mapped submission queue ring
+  size_t               sq_size;  // size of the mapped submission queue ring
+  void                *cq_ptr;   // mapped completion queue ring, same as sq_ptr with IORING_FEAT_SINGLE_MMAP
+  size_t               cq_size;  // size of the mapped completion queue ring
+  struct io_uring_sqe *sqes;     // mapped submission queue entries
+  size_t               sqes_size;
+  unsigned            *sq_head;
+  unsigned            *sq_tail;
+  unsigned            *sq_mask;
+  unsigned            *sq_array;
+  unsigned            *cq_head;
+  unsigned            *cq_tail;
+  unsigned            *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned             pending;  // number of entries prepared and not yet submitted
+  bool                 failed;   // true when io_uring_enter() failed, the ring is no longer used
+
+  // prepare a new submission queue entry
+  struct io_uring_sqe *next()
+  {
+    unsigned tail = *sq_tail + pending;
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    ++pending;
+    return sqe;
+  }
+
+  // submit the prepared entries and wait for n completions, calling done(user_data, res) for each, returns false when io_uring_enter()
+  // failed, then the entries not consumed by the kernel are withdrawn and the completions of the entries consumed are awaited by polling
+  // the completion queue, so no request is in flight when this function returns
+  template<typename F>
+  bool submit(unsigned n, F done)
+  {
+    unsigned tail = *sq_tail + pending;
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+    pending = 0;
+
+    while (n > 0)
+    {
+      if (!failed)
+      {
+        unsigned to_submit = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, fd, to_submit, n, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+        {
+          // withdraw the entries not consumed by the kernel, which have no completions
+          unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+          n -= tail - head;
+          tail = head;
+          __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+          failed = true;
+        }
+      }
+      else
+      {
+        sched_yield();
+      }
+
+      unsigned head = *cq_head;
+      while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+      {
+        const struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        done(cqe->user_data, cqe->res);
+        ++head;
+        --n;
+      }
+      __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return !failed;
+  }
+
+};
+
+Uring::Uring()
+  :
+    ring(NULL),
+    entries(0)
+{ }
+
+Uring::~Uring()
+{
+  if (ring != NULL)
+  {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr)
+      munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+    delete ring;
+  }
+}
+
+bool Uring::init(unsigned entries)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  if (fd < 0)
+    return false;
+
+  // Linux 5.6 or greater is required to open and close files
+  if ((params.features & IORING_FEAT_RW_CUR_POS) == 0)
+  {
+    close(fd);
+    return false;
+  }
+
+  Ring *r = new Ring;
+  r->fd = fd;
+  r->pending = 0;
+  r->failed = false;
+  r->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  r->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+    r->sq_size = r->cq_size = std::max(r->sq_size, r->cq_size);
+  r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED)
+  {
+    close(fd);
+    delete r;
+    return false;
+  }
+
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+  {
+    r->cq_ptr = r->sq_ptr;
+  }
+  else
+  {
+    r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED)
+    {
+      munmap(r->sq_ptr, r->sq_size);
+      close(fd);
+      delete r;
+      return false;
+    }
+  }
+
+  r->sqes = static_cast<struct io_uring_sqe*>(mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+  if (r->sqes == MAP_FAILED)
+  {
+    if (r->cq_ptr != r->sq_ptr)
+      munmap(r->cq_ptr, r->cq_size);
+    munmap(r->sq_ptr, r->sq_size);
+    close(fd);
+    delete r;
+    return false;
+  }
+
+  char *sq = static_cast<char*>(r->sq_ptr);
+  char *cq = static_cast<char*>(r->cq_ptr);
+  r->sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  r->sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  r->sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  r->sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  r->cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  r->cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  r->cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  r->cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+  ring = r;
+  this->entries = params.sq_entries;
+
+  return true;
+}
+
+void Uring::read(size_t n, const char *const *pathnames, char *const *buffers, size_t size, int64_t *sizes, bool drop)
+{
+  std::vector<int> fds(n, -1);
+  std::vector<char> closed(n);
+
+  for (size_t i = 0; i < n; ++i)
+    sizes[i] = -1;
+
+  // the ring is no longer used after io_uring_enter() failed, the caller reads the files instead
+  if (ring->failed)
+    return;
+
+  // open the files
+  for (size_t i = 0; i < n; ++i)
+  {
+    struct io_uring_sqe *sqe = ring->next();
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = reinterpret_cast<uintptr_t>(pathnames[i]);
+    sqe->open_flags = O_RDONLY | O_NOCTTY | O_CLOEXEC;
+    sqe->user_data = i;
+  }
+  bool ok = ring->submit(static_cast<unsigned>(n), [&](uint64_t i, int res) {
+      if (res >= 0)
+        fds[i] = res;
+  });
+
+  // read the opened files
+  unsigned reads = 0;
+  for (size_t i = 0; i < n && ok; ++i)
+  {
+    if (fds[i] >= 0)
+    {
+      struct io_uring_sqe *sqe = ring->next();
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = fds[i];
+      sqe->addr = reinterpret_cast<uintptr_t>(buffers[i]);
+      sqe->len = static_cast<uint32_t>(size);
+      sqe->off = 0;
+      sqe->user_data = i;
+      ++reads;
+    }
+  }
+  ok = ok && ring->submit(reads, [&](uint64_t i, int res) {
+      if (res >= 0)
+        sizes[i] = res;
+  });
+
+  // close the opened files, drop their cached pages first when requested
+  unsigned closes = 0;
+  for (size_t i = 0; i < n && !ring->failed; ++i)
+  {
+    if (fds[i] >= 0)
+    {
+      struct io_uring_sqe *sqe;
+      if (drop)
+      {
+        sqe = ring->next();
+        sqe->opcode = IORING_OP_FADVISE;
+        sqe->fd = fds[i];
+        sqe->fadvise_advice = POSIX_FADV_DONTNEED;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = n;
+        ++closes;
+      }
+      sqe = ring->next();
+      sqe->opcode = IORING_OP_CLOSE;
+      sqe->fd = fds[i];
+      sqe->user_data = i;
+      ++closes;
+    }
+  }
+  ring->submit(closes, [&](uint64_t i, int res) {
+      // close the file when the close request failed
+      if (i < n)
+      {
+        if (res < 0 && res != -EBADF)
+          close(fds[i]);
+        closed[i] = true;
+      }
+  });
+
+  // close the files that were not closed by the ring when io_uring_enter() failed
+  for (size_t i = 0; i < n; ++i)
+    if (fds[i] >= 0 && !closed[i])
+      close(fds[i]);
+
+  // the files are read by the caller instead when io_uring_enter() failed
+  if (!ok)
+    for (size_t i = 0; i < n; ++i)
+      sizes[i] = -1;
+}
+
+#else
+
+// io_uring is not available
+
+Uring::Uring()
+  :
+    ring(NULL),
+    entries(0)
+{ }
+
+Uring::~Uring()
+{ }
+
+bool Uring::init(unsigned)
+{
+  return false;
+}
+
+void Uring::read(size_t n, const char *const *, char *const *, size_t, int64_t *sizes, bool)
+{
+  for (size_t i = 0; i < n; ++i)
+    sizes[i] = -1;
+}
+
+#endif
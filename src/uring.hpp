@@ -0,0 +1,73 @@
+/******************************************************************************\
+* Copyright (c) 2023, Robert van Engelen, Genivia Inc. All rights reserved.    *
+*                                                                              *
+* Redistribution and use in source and binary forms, with or without           *
+* modification, are permitted provided that the following conditions are met:  *
+*                                                                              *
+*   (1) Redistributions of source code must retain the above copyright notice, *
+*       this list of conditions and the following disclaimer.                  *
+*                                                                              *
+*   (2) Redistributions in binary form must reproduce the above copyright      *
+*       notice, this list of conditions and the following disclaimer in the    *
+*       documentation and/or other materials provided with the distribution.   *
+*                                                                              *
+*   (3) The name of the author may not be used to endorse or promote products  *
+*       derived from this software without specific prior written permission.  *
+*                                                                              *
+* THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED *
+* WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF         *
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO   *
+* EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,       *
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, *
+* PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;  *
+* OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,     *
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR      *
+* OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF       *
+* ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.                                   *
+\******************************************************************************/
+
+/**
+@file      uring.hpp
+@brief     batched file reads with io_uring
+@author    Robert van Engelen - engelen@genivia.com
+@copyright (c) 2023-2025, Robert van Engelen, Genivia Inc. All rights reserved.
+@copyright (c) BSD-3 License - see LICENSE.txt
+*/
+
+#ifndef URING_HPP
+#define URING_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// an io_uring to open, read and close a batch of files with a few system calls, not thread safe, use one per thread
+class Uring {
+
+ public:
+
+  Uring();
+
+  ~Uring();
+
+  // set up the io_uring with room for a batch of entries / 2 files, returns false when io_uring is not available
+  bool init(unsigned entries);
+
+  // max number of files to read in one batch
+  size_t batch() const
+  {
+    return entries / 2;
+  }
+
+  // read n <= batch() files pathnames[i] into buffers[i] of the given size, sizes[i] is the number of bytes read or -1 when the file cannot be read, with drop the cached pages of the files are dropped
+  void read(size_t n, const char *const *pathnames, char *const *buffers, size_t size, int64_t *sizes, bool drop);
+
+ private:
+
+  struct Ring; // the memory mapped submission and completion queues
+
+  Ring    *ring;    // NULL when io_uring is not available
+  unsigned entries; // number of submission queue entries
+
+};
+
+#endif